@@ -1,3 +1,4 @@
+#define _GNU_SOURCE // recvmmsg/sendmmsg
 #include <arpa/inet.h>
 #include<errno.h>
 #include<stdio.h>
@@ -14,14 +15,53 @@
 #include <string.h>
 #include <stdlib.h>
 #include <poll.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
 #include <time.h>
+#include <sys/un.h>
+#include <sys/ioctl.h>
+#include <linux/if_tun.h>
 #include <asm-generic/signal-defs.h>
 #include <asm-generic/fcntl.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+/* Log levels: 0 errors only, 1 connection events and the stats dump,
+ * 2 every segment, FSM step and congestion control step. Under load the
+ * per segment printfs cost more than the stack: build with -DLOG_LEVEL=1. */
+#ifndef LOG_LEVEL
+#define LOG_LEVEL 2
+#endif
+#define LOG_INFO(...) do{ if(LOG_LEVEL >= 1) printf(__VA_ARGS__); }while(0)
+#define LOG_TRACE(...) do{ if(LOG_LEVEL >= 2) printf(__VA_ARGS__); }while(0)
+
+#ifdef SHARDS /* NSHARDS event loops, one PACKET_FANOUT member each: build with -DSHARDS -pthread */
+#ifndef EVLOOP
+#define EVLOOP
+#endif
+#ifndef NSHARDS
+#define NSHARDS 4
+#endif
+#define SHARD_LOCAL __thread // one instance per worker thread
+#include <sys/eventfd.h>
+#include <linux/filter.h>
+#else
+#define SHARD_LOCAL
+#endif
+#include <sys/epoll.h> // struct epoll_event also for myepoll_wait()
+#ifdef EVLOOP /* epoll+timerfd engine: build with -DEVLOOP -pthread */
+#include <sys/timerfd.h>
+#include <pthread.h>
+#endif
 
 
 #define MAXFRAME 30000
 #define TIMER_USECS 500
-#define RXBUFSIZE 64000
+#define RXBUFSIZE 64000 // default, per socket with mysetsockopt(SO_RCVBUF)
+#define MAX_RXBUFSIZE (1<<30) // 65535 << 14, the largest window scaling can advertise
 #define MAXTIMEOUT 2000
 #define MAXRTO MAXTIMEOUT
 
@@ -39,18 +79,128 @@ int g_argc; // Global Argc
 
 char * usage_string = "%s <port> [<TXBUFSIZE (default 100K)>] [<TIMEOUT msec (default 300)>] [MODE: <SRV|CLN> (default SRV)] [1/LOSSRATE <1/N> (default 10000)\n";
 unsigned char  mssopt[4] = { 0x02, 0x04, 0x05, 0x90};
-struct sigaction action_io, action_timer;
+struct sigaction action_io, action_timer, action_pace;
 sigset_t mymask;
-unsigned char l2buffer[MAXFRAME];
+#define SIGPACE SIGRTMIN // pacing timer of the signal engine
+#define RX_BATCH 32
+SHARD_LOCAL unsigned char l2buffer[RX_BATCH][MAXFRAME];
 struct sockaddr_ll;
-struct pollfd fds[1];
+SHARD_LOCAL struct sockaddr_ll rx_from[RX_BATCH];
+SHARD_LOCAL struct iovec rx_iov[RX_BATCH];
+SHARD_LOCAL struct mmsghdr rx_msgs[RX_BATCH];
+/* TPACKET_V3 receive ring, NULL when the kernel refused it (recvmmsg fallback) */
+#define RX_BLOCK_SIZE (1<<20)
+#define RX_BLOCK_NR 16
+#define RX_BLOCK_TOV 1 // msec before a partially filled block is handed to us
+SHARD_LOCAL unsigned char * rx_ring;
+struct tpacket_req3 rx_req;
+SHARD_LOCAL unsigned int rx_block;
 int fdfl;
+SHARD_LOCAL int unique_s;
+SHARD_LOCAL int fl;
+
+/* Stack critical section.
+ * Signal engine: SIGIO/SIGALRM (and SIGPACE with CONGCTRL) masked, waiters sigsuspend() until a handler ran.
+ * EVLOOP engine: a recursive mutex owned by the event loop thread while it runs
+ * myio/mytimer; waiters sleep on a condition variable broadcast after each pass.
+ * SHARDS: the same per shard. A worker takes its own; an API call first
+ * selects the shard owning the socket with SHARD_ENTER(s). */
+#ifdef SHARDS
+pthread_mutex_t stack_mtx[NSHARDS];
+pthread_cond_t stack_cv[NSHARDS];
+int stack_waiters[NSHARDS];
+long long shard_tick[NSHARDS];
+__thread int me; //shard we work for
+__thread int is_worker; //this thread runs shard me: its SHARD_LOCAL state is that shard's
+__thread int epfd, tfd;
+#define tick shard_tick[me]
+#define SHARD_ID me
+#define SHARD_ENTER(s) (me = fdinfo[s].shard)
+#define SHARD_MINE(s) (fdinfo[s].shard == me)
+#define STACK_LOCK() pthread_mutex_lock(&stack_mtx[me])
+#define STACK_UNLOCK() pthread_mutex_unlock(&stack_mtx[me])
+#define STACK_WAIT() (stack_waiters[me]++, pthread_cond_wait(&stack_cv[me],&stack_mtx[me]), stack_waiters[me]--, 1)
+#define STACK_WAKE() if(stack_waiters[me]) pthread_cond_broadcast(&stack_cv[me])
+/* Demux tables: looked up by every worker, changed by the application and by
+ * the worker freeing a connection */
+pthread_rwlock_t tables_lock = PTHREAD_RWLOCK_INITIALIZER;
+#define TABLES_RDLOCK() pthread_rwlock_rdlock(&tables_lock)
+#define TABLES_WRLOCK() pthread_rwlock_wrlock(&tables_lock)
+#define TABLES_UNLOCK() pthread_rwlock_unlock(&tables_lock)
+#else
 long long int tick=0;
-int unique_s;
-int fl;
+#undef NSHARDS
+#define NSHARDS 1 //a single engine
+#define SHARD_ID 0
+#define SHARD_ENTER(s) ((void)0)
+#define SHARD_MINE(s) 1
+#define TABLES_RDLOCK() ((void)0)
+#define TABLES_WRLOCK() ((void)0)
+#define TABLES_UNLOCK() ((void)0)
+#endif
+#if defined(EVLOOP) && !defined(SHARDS)
+pthread_mutex_t stack_mtx;
+pthread_cond_t stack_cv = PTHREAD_COND_INITIALIZER;
+int stack_waiters;
+int epfd, tfd;
+#define STACK_LOCK() pthread_mutex_lock(&stack_mtx)
+#define STACK_UNLOCK() pthread_mutex_unlock(&stack_mtx)
+#define STACK_WAIT() (stack_waiters++, pthread_cond_wait(&stack_cv,&stack_mtx), stack_waiters--, 1)
+#define STACK_WAKE() if(stack_waiters) pthread_cond_broadcast(&stack_cv)
+#elif !defined(EVLOOP)
+sigset_t waitmask; //empty: every signal allowed while waiting
+#define STACK_LOCK() sigprocmask(SIG_BLOCK, &mymask, NULL)
+#define STACK_UNLOCK() sigprocmask(SIG_UNBLOCK, &mymask, NULL)
+#define STACK_WAIT() (sigsuspend(&waitmask), 1)
+#endif
+
+/* Counters: plain increments by the only thread running the shard, read
+ * without locks. A connection keeps its own in the tcb (TCP_INFO), each
+ * shard the stack totals in a cache line of its own (mystats()). */
+struct tcp_counters{
+unsigned long long segs_in, segs_out;
+unsigned long long retrans; //segments sent again, for any reason
+unsigned long long rtos; //retransmissions because the RTO expired
+unsigned long long fast_retrans; //after three duplicate ACKs or a SACK hole
+unsigned long long dup_acks; //CONGCTRL only
+unsigned long long ooo_bytes; //received past a hole
+};
+
+struct stack_counters{
+struct tcp_counters tcp; //all connections of the shard, closed ones included
+unsigned long long arp_misses; //frames parked waiting for a next hop
+unsigned long long arp_drops; //parked frames given up, or not parked: queue full
+unsigned long long handoff_drops; //SHARDS: frames another shard could not take
+unsigned long long tx_batches, tx_frames; //link send calls (sendmmsg, write, sendto) and the frames they carried
+int arp_pending; //next hops being resolved, of ARP_PENDING
+int sockets; //descriptors in use, of MAX_FD: filled by mystats()
+long long txbuf_bytes, rxbuf_bytes; //send and receive rings the stack allocated (lent ones excluded)
+long long txq_slots; //segment descriptors allocated in the txq rings
+} __attribute__((aligned(64))) stack_cnt[NSHARDS];
+
+#define STAT(f) (stack_cnt[SHARD_ID].f++)
+#define TCB_STAT(t,f) ((t)->cnt.f++, stack_cnt[SHARD_ID].tcp.f++)
+#define TCB_STAT_ADD(t,f,n) ((t)->cnt.f += (n), stack_cnt[SHARD_ID].tcp.f += (n))
 
 struct sockaddr_ll sll;
 
+/* Link layer backend, chosen at start by MYTCP_LINK=<name>[:<arg>]:
+ * packet[:ifname] AF_PACKET on a real interface (eth0), the default
+ * tap[:ifname]    a TAP device (tap0), its other side is the host kernel
+ * wire:<local>,<peer>[,delay us,rate Mbit/s,loss %,reorder %]
+ *                 AF_UNIX datagrams to another mytcp process on this host,
+ *                 through an emulated link
+ * unique_s is the descriptor whose readiness (SIGIO or epoll) calls myio(). */
+struct link_ops{
+char * name;
+int (*open)(char * arg); //sets unique_s
+void (*recv)(); //process_frame() on every frame waiting
+void (*send)(); //the tx_n frames of the TX batch
+void (*timer)(); //every tick, if not NULL
+};
+struct link_ops * phy;
+char * phy_arg;
+
 int printbuf(void * b, int size){
         int i;
         unsigned char * c = (unsigned char *) b;
@@ -59,16 +209,93 @@ int printbuf(void * b, int size){
         printf("\n");
 }
 
+// compiled in defaults, MYTCP_IP, MYTCP_MAC and MYTCP_GW replace them (link_config)
 unsigned char myip[4] = { 212,71,252,26};
 unsigned char mymac[6] ={0xf2,0x3c,0x94,0x90,0x4f,0x4b}; // {0xf2,0x3c,0x91,0xdb,0xc2,0x98};
 unsigned char mask[4] = { 255,255,255,0 };
 unsigned char gateway[4] = {212,71,252,1}; //{ 88,80,187,1 };
 
+long long monotonic_ns(){
+struct timespec ts;
+clock_gettime(CLOCK_MONOTONIC, &ts);
+return ts.tv_sec*1000000000LL + ts.tv_nsec;
+}
+
+/* Binary trace (-DTRACE): one ring of 1<<TRACE_BITS fixed size events per
+ * shard, in a file mapped MAP_SHARED, so that it survives a crash and can be
+ * read while we run. A ring is written only under the stack lock of its
+ * shard: the event first, then head with release order. mytrace.c decodes
+ * the file and draws time-sequence graphs. */
+#define TR_FSM 1 // a: old state, b: new state, c: input
+#define TR_CWND 2 // a: cwnd, b: ssthresh, c: cong_st, d: flightsize
+#define TR_RTO 3 // a: seq, b: RTO (us), c: retry
+#define TR_TX 4 // a: seq, b: ack, c: payload, d: flags | retry << 8
+#define TR_RX 5 // a: seq, b: ack, c: payload, d: flags | window << 8
+#define TR_RTT 6 // a: sample, b: srtt, c: rttvar, d: RTO, all us
+#ifdef TRACE
+#ifndef TRACE_BITS
+#define TRACE_BITS 16 // 2 MB per shard
+#endif
+#ifndef TRACE_FILE
+#define TRACE_FILE "mytcp.trace"
+#endif
+#define TRACE_MAGIC 0x54524331 // "TRC1"
+struct trace_ev{
+long long ns; //CLOCK_MONOTONIC
+unsigned short type, sock;
+unsigned int a, b, c, d; //seq/ack relative to the ISNs, as the printfs
+};
+struct trace_hdr{
+unsigned int magic, bits, rings, evsize;
+};
+struct trace_ring{
+unsigned long long head; //events written so far, the oldest ones overwritten
+unsigned long long pad[3];
+struct trace_ev ev[1<<TRACE_BITS];
+};
+struct trace_ring * trace_rings; //NSHARDS of them after the 64 byte header
+
+void trace_ev(int type, int sock, unsigned int a, unsigned int b, unsigned int c, unsigned int d){
+struct trace_ring * r;
+struct trace_ev * e;
+if(trace_rings == NULL) return;
+r = trace_rings + SHARD_ID;
+e = r->ev + (r->head & ((1<<TRACE_BITS)-1));
+e->ns = monotonic_ns();
+e->type = type;
+e->sock = sock;
+e->a = a; e->b = b; e->c = c; e->d = d;
+__atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+}
+
+int trace_open(){
+int fd;
+size_t len = 64 + NSHARDS*sizeof(struct trace_ring);
+unsigned char * m;
+if((fd = open(TRACE_FILE, O_RDWR|O_CREAT|O_TRUNC, 0644)) == -1){ perror("trace open"); return -1;}
+if(-1 == ftruncate(fd, len)){ perror("trace ftruncate"); close(fd); return -1;}
+m = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+close(fd);
+if(m == MAP_FAILED){ perror("trace mmap"); return -1;}
+*(struct trace_hdr *) m = (struct trace_hdr){ TRACE_MAGIC, TRACE_BITS, NSHARDS, sizeof(struct trace_ev) };
+trace_rings = (struct trace_ring *)(m + 64);
+return 0;
+}
+#define TRACE_EV(type,sock,a,b,c,d) trace_ev(type,sock,a,b,c,d)
+#else
+#define TRACE_EV(type,sock,a,b,c,d) ((void)0)
+#endif
+
+/* Our RFC 7323 timestamp clock: microseconds, wraps every 71 minutes */
+unsigned int ts_now(){
+return monotonic_ns()/1000;
+}
+
 unsigned long int rtclock(int cmd){
-static struct timeval tv,zero;
-gettimeofday(&tv,NULL);
-if(cmd==1) zero = tv;
-return (tv.tv_sec - zero.tv_sec)*1000000 + (tv.tv_usec - zero.tv_usec);
+static long long zero;
+long long now = monotonic_ns();
+if(cmd==1) zero = now;
+return (now - zero)/1000;
 }
 
 struct icmp_packet{
@@ -94,7 +321,7 @@ unsigned int dstaddr;
 unsigned char payload[20];
 };
 
-int resolve_mac(unsigned int destip, unsigned char * destmac);
+void myio(int number);
 
 struct arp_packet {
 unsigned short int htype;
@@ -124,53 +351,74 @@ for(int i=0; i<l; i++) if(b1[i]!=b2[i]) return 0;
 return 1;
 }
 
-unsigned short int compl1( char * b, int len)
+/* Internet checksum kernel.
+ * csum_add accumulates buf as 32 bit words in the host byte order into a 64 bit
+ * sum, so carries are folded only once by csum_fold. Partial sums of buffers
+ * that start at even offsets of the same packet can be added together
+ * (RFC 1071), which lets a segment cache the sum of the parts that never change. */
+unsigned long long csum_add(const void * buf, int len, unsigned long long sum)
 {
-unsigned short total = 0;
-unsigned short prev = 0;
-unsigned short *p = (unsigned short * ) b;
-int i;
-for(i=0; i < len/2 ; i++){
-        total += ntohs(p[i]);
-        if (total < prev ) total++;
-        prev = total;
+const unsigned char * p = (const unsigned char *) buf;
+unsigned int w;
+unsigned short h;
+#if defined(__AVX2__)
+if(len >= 64){
+        __m256i acc = _mm256_setzero_si256(), zero = _mm256_setzero_si256();
+        unsigned long long lanes[4];
+        for( ; len >= 32; p += 32, len -= 32){
+                __m256i v = _mm256_loadu_si256((const __m256i *) p);
+                acc = _mm256_add_epi64(acc, _mm256_unpacklo_epi32(v, zero));
+                acc = _mm256_add_epi64(acc, _mm256_unpackhi_epi32(v, zero));
+                }
+        _mm256_storeu_si256((__m256i *) lanes, acc);
+        sum += lanes[0] + lanes[1] + lanes[2] + lanes[3];
         }
-if ( i*2 != len){
-        //total += htons(b[len-1]<<8);
-        total += htons(p[len/2])&0xFF00;
-        if (total < prev ) total++;
-        prev = total;
+#elif defined(__SSE2__)
+if(len >= 32){
+        __m128i acc = _mm_setzero_si128(), zero = _mm_setzero_si128();
+        unsigned long long lanes[2];
+        for( ; len >= 16; p += 16, len -= 16){
+                __m128i v = _mm_loadu_si128((const __m128i *) p);
+                acc = _mm_add_epi64(acc, _mm_unpacklo_epi32(v, zero));
+                acc = _mm_add_epi64(acc, _mm_unpackhi_epi32(v, zero));
+                }
+        _mm_storeu_si128((__m128i *) lanes, acc);
+        sum += lanes[0] + lanes[1];
         }
-return (total);
+#endif
+for( ; len >= 4; p += 4, len -= 4){ memcpy(&w, p, 4); sum += w; }
+if(len >= 2){ memcpy(&h, p, 2); sum += h; p += 2; len -= 2; }
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+if(len) sum += *p << 8;
+#else
+if(len) sum += *p; // odd byte: first half of a 16 bit word in network order
+#endif
+return sum;
+}
+
+/* Folds a csum_add sum to 16 bits, still in the host byte order of the words */
+unsigned short csum_fold(unsigned long long sum)
+{
+sum = (sum & 0xFFFFFFFF) + (sum >> 32);
+sum = (sum & 0xFFFFFFFF) + (sum >> 32);
+sum = (sum & 0xFFFF) + (sum >> 16);
+sum = (sum & 0xFFFF) + (sum >> 16);
+return (unsigned short) sum;
+}
+
+unsigned short int compl1( char * b, int len)
+{
+return ntohs(csum_fold(csum_add(b, len, 0)));
 }
 
 unsigned short int checksum2 ( char * b1, int len1, char* b2, int len2)
 {
-unsigned short prev, total;
-prev = compl1(b1,len1);
-total = (prev + compl1(b2,len2));
-if (total < prev ) total++;
-return (0xFFFF - total);
+return (0xFFFF - ntohs(csum_fold(csum_add(b2, len2, csum_add(b1, len1, 0)))));
 }
 
 unsigned short int checksum ( char * b, int len)
 {
-unsigned short total = 0;
-unsigned short prev = 0;
-unsigned short *p = (unsigned short * ) b;
-int i;
-for(i=0; i < len/2 ; i++){
-        total += ntohs(p[i]);
-        if (total < prev ) total++;
-        prev = total;
-        }
-if ( i*2 != len){
-        //total += htons(b[len-1]<<8);
-        total += htons(p[len/2])&0xFF00;
-        if (total < prev ) total++;
-        prev = total;
-        }
-return (0xFFFF-total);
+return (0xFFFF - compl1(b, len));
 }
 
 void forge_icmp_echo(struct icmp_packet * icmp, int payloadsize)
@@ -210,26 +458,228 @@ eth->type=htons(type);
 };
 
 
+/* ARP cache: open addressing with linear probing on the IPv4 address.
+ * Slots are never emptied, an expired one is only reused, so a probe ends
+ * at the first empty slot. The last next hop, most often the gateway, is
+ * also kept per shard: send_ip() finds it without touching the table.
+ * SHARDS: the table is read under TABLES_RDLOCK and changed under
+ * TABLES_WRLOCK; arp_gen moves when a MAC changes and voids every arp_last. */
+#ifndef ARP_BITS
+#define ARP_BITS 8
+#endif
+#define ARP_SIZE (1<<ARP_BITS)
+#define ARP_TTL (60*1000000LL/TIMER_USECS) // ticks an answer is trusted
+
+struct arpcacheline {
+unsigned int key; //IP address, 0 = empty
+unsigned char mac[6]; //Mac address
+long long expiry; //tick
+}arpcache[ARP_SIZE];
+unsigned int arp_gen;
+SHARD_LOCAL struct arpcacheline arp_last;
+SHARD_LOCAL unsigned int arp_last_gen;
+
+unsigned int arp_hashfn(unsigned int ip){
+return (ip * 2654435761u) >> (32 - ARP_BITS);
+}
+
+/* 0 and the MAC of ip if it is known and fresh */
+int arp_lookup(unsigned int ip, unsigned char * mac){
+unsigned int h, n;
+int found = -1;
+if(arp_last.key == ip && arp_last.expiry > tick && arp_last_gen == __atomic_load_n(&arp_gen, __ATOMIC_ACQUIRE)){
+        memcpy(mac, arp_last.mac, 6);
+        return 0;
+        }
+TABLES_RDLOCK();
+for(h = arp_hashfn(ip), n = 0; n < ARP_SIZE && arpcache[h].key != 0; h = (h+1) & (ARP_SIZE-1), n++)
+        if(arpcache[h].key == ip){
+                if(arpcache[h].expiry > tick){
+                        arp_last = arpcache[h];
+                        arp_last_gen = __atomic_load_n(&arp_gen, __ATOMIC_ACQUIRE);
+                        memcpy(mac, arp_last.mac, 6);
+                        found = 0;
+                        }
+                break;
+                }
+TABLES_UNLOCK();
+return found;
+}
+
+/* An ARP reply: refresh the entry of ip, or take an empty or expired slot
+ * along its probe, or as a last resort evict the home slot */
+void arp_insert(unsigned int ip, unsigned char * mac){
+unsigned int h, n, slot = ARP_SIZE;
+TABLES_WRLOCK();
+for(h = arp_hashfn(ip), n = 0; n < ARP_SIZE; h = (h+1) & (ARP_SIZE-1), n++){
+        if(arpcache[h].key == ip || arpcache[h].key == 0){ slot = h; break;}
+        if(slot == ARP_SIZE && arpcache[h].expiry <= tick) slot = h;
+        }
+if(slot == ARP_SIZE) slot = arp_hashfn(ip);
+if(arpcache[slot].key != ip || memcmp(arpcache[slot].mac, mac, 6))
+        __atomic_fetch_add(&arp_gen, 1, __ATOMIC_RELEASE); //a cached next hop may be this slot
+arpcache[slot].key = ip;
+memcpy(arpcache[slot].mac, mac, 6);
+arpcache[slot].expiry = tick + ARP_TTL;
+TABLES_UNLOCK();
+}
+
+/* TX batch: send_ip() queues frames here, tx_flush() pushes them out with a
+ * single sendmmsg() at the end of each mytimer/myio pass (or when full). */
+#define TX_BATCH 64
+SHARD_LOCAL unsigned char txframes[TX_BATCH][2000];
+SHARD_LOCAL struct iovec tx_iov[TX_BATCH];
+SHARD_LOCAL struct mmsghdr tx_msgs[TX_BATCH];
+SHARD_LOCAL int tx_n;
+
+void tx_flush(){
+if(tx_n) phy->send();
+tx_n = 0;
+}
+
+/* Frames waiting for the MAC of their next hop: send_ip() parks them and
+ * asks, the reply releases them. If the reply reached another shard, the
+ * timer finds the answer in the table. After ARP_TRIES unanswered requests
+ * the frames are dropped and retransmissions start over. */
+#define ARP_PENDING 16 // next hops being resolved at the same time
+#define ARP_QLEN 8 // frames parked on each
+#define ARP_RETRY (100000/TIMER_USECS)
+#define ARP_TRIES 3
+
+struct arp_pending{
+unsigned int ip; //0 = free
+int tries;
+long long next; //tick of the next request
+int n;
+int len[ARP_QLEN];
+unsigned char frame[ARP_QLEN][2000];
+};
+SHARD_LOCAL struct arp_pending arp_pend[ARP_PENDING];
+SHARD_LOCAL int arp_pend_n;
+
+/* ARP frame from us, out with the next flush: a request (op 1) is broadcast,
+ * a reply (op 2) goes to dstmac */
+void arp_send(int op, unsigned char * dstmac, unsigned int destip){
+int i;
+unsigned char pkt[1500];
+struct ethernet_frame *eth;
+struct arp_packet *arp;
+eth = (struct ethernet_frame *) pkt;
+arp = (struct arp_packet *) eth->payload;
+for(i=0;i<6;i++) eth->dstmac[i]=(op == 1) ? 0xff : dstmac[i];
+for(i=0;i<6;i++) eth->srcmac[i]=mymac[i];
+eth->type=htons(0x0806);
+arp->htype=htons(1);
+arp->ptype=htons(0x0800);
+arp->hlen=6;
+arp->plen=4;
+arp->op=htons(op);
+for(i=0;i<6;i++) arp->srcmac[i]=mymac[i];
+for(i=0;i<4;i++) arp->srcip[i]=myip[i];
+for(i=0;i<6;i++) arp->dstmac[i]=(op == 1) ? 0 : dstmac[i];
+for(i=0;i<4;i++) arp->dstip[i]=((unsigned char*) &destip)[i];
+//printbuf(pkt,14+sizeof(struct arp_packet));
+if(tx_n == TX_BATCH) tx_flush();
+memcpy(txframes[tx_n], pkt, 14+sizeof(struct arp_packet));
+tx_iov[tx_n++].iov_len = 14+sizeof(struct arp_packet);
+}
+
+void arp_request(unsigned int destip){
+arp_send(1, NULL, destip);
+}
+
+/* Queue of ip, opened with a first request if there is none; NULL if full */
+struct arp_pending * arp_park(unsigned int ip){
+struct arp_pending * p, * free = NULL;
+for(p = arp_pend; p < arp_pend + ARP_PENDING; p++){
+        if(p->ip == ip) return (p->n < ARP_QLEN) ? p : NULL;
+        if(p->ip == 0 && free == NULL) free = p;
+        }
+if(free == NULL) return NULL;
+free->ip = ip;
+free->tries = 1;
+free->next = tick + ARP_RETRY;
+free->n = 0;
+arp_pend_n++;
+arp_request(ip);
+return free;
+}
+
+/* Parked frames go in the TX batch, to mac */
+void arp_release(struct arp_pending * p, unsigned char * mac){
+int k;
+for(k=0; k<p->n; k++){
+        if(tx_n == TX_BATCH) tx_flush();
+        memcpy(txframes[tx_n], p->frame[k], p->len[k]);
+        memcpy(((struct ethernet_frame *) txframes[tx_n])->dstmac, mac, 6);
+        tx_iov[tx_n].iov_len = p->len[k];
+        tx_n++;
+        }
+p->ip = 0;
+arp_pend_n--;
+}
+
+/* An ARP reply for ip was handled */
+void arp_resolved(unsigned int ip, unsigned char * mac){
+struct arp_pending * p;
+if(arp_pend_n)
+        for(p = arp_pend; p < arp_pend + ARP_PENDING; p++)
+                if(p->ip == ip) { arp_release(p, mac); return;}
+}
+
+/* Every tick: answers learnt elsewhere, retries and give-ups */
+void arp_timer(){
+struct arp_pending * p;
+unsigned char mac[6];
+stack_cnt[SHARD_ID].arp_pending = arp_pend_n;
+if(arp_pend_n == 0) return;
+for(p = arp_pend; p < arp_pend + ARP_PENDING; p++){
+        if(p->ip == 0) continue;
+        if(arp_lookup(p->ip, mac) == 0) arp_release(p, mac);
+        else if(tick >= p->next){
+                if(p->tries++ == ARP_TRIES){
+                        LOG_INFO("%.7ld: ARP: no answer from %s, %d frames dropped\n",rtclock(0),inet_ntoa(*(struct in_addr *)&p->ip),p->n);
+                        stack_cnt[SHARD_ID].arp_drops += p->n;
+                        p->ip = 0;
+                        arp_pend_n--;
+                        continue;
+                        }
+                p->next = tick + ARP_RETRY;
+                arp_request(p->ip);
+                }
+        }
+}
+
 int send_ip(unsigned char * payload, unsigned char * targetip, int payloadlen, unsigned char proto)
 {
 static int losscounter;
-int i,t,len ;
+unsigned int nexthop;
 unsigned char destmac[6];
-unsigned char packet[2000];
-struct ethernet_frame * eth = (struct ethernet_frame *) packet;
-struct ip_datagram * ip = (struct ip_datagram *) eth->payload;
+unsigned char * packet;
+struct ethernet_frame * eth;
+struct ip_datagram * ip;
+struct arp_pending * p = NULL;
 
-if(!(rand()%INV_LOSS_RATE) && g_argv[4][0]=='S') {printf("==========TX LOST ===============\n");return 1;}
-if((losscounter++ == 25)  &&(g_argv[4][0]=='S')){printf("==========TX LOST ===============\n");return 1;}
+if(!(rand()%INV_LOSS_RATE) && g_argv[4][0]=='S') {LOG_TRACE("==========TX LOST ===============\n");return 1;}
+if((losscounter++ == 25)  &&(g_argv[4][0]=='S')){LOG_TRACE("==========TX LOST ===============\n");return 1;}
 /**** HOST ROUTING */
 if( ((*(unsigned int*)targetip) & (*(unsigned int*) mask)) == ((*(unsigned int*)myip) & (*(unsigned int*) mask)))  //The
-        t = resolve_mac(*(unsigned int *)targetip, destmac); // if yes
+        nexthop = *(unsigned int *)targetip; // if yes
 else
-        t = resolve_mac(*(unsigned int *)gateway, destmac); // if not
-
-if(t==-1) return -1;
+        nexthop = *(unsigned int *)gateway; // if not
 
+if(arp_lookup(nexthop, destmac) == -1){ //parked until the next hop answers
+        if((p = arp_park(nexthop)) == NULL) { STAT(arp_drops); return -1;}
+        STAT(arp_misses);
+        packet = p->frame[p->n];
+        }
+else {
+        if(tx_n == TX_BATCH) tx_flush();
+        packet = txframes[tx_n];
+        }
 ;//printf("destmac: ");printbuf(destmac,6);
+eth = (struct ethernet_frame *) packet;
+ip = (struct ip_datagram *) eth->payload;
 
 forge_ethernet(eth,destmac,0x0800);
 forge_ip(ip,payloadlen,proto,*(unsigned int *)targetip);
@@ -240,24 +690,17 @@ memcpy(ip->payload,payload,payloadlen);
 ;//printf("\n");
 */
 //printbuf(packet+14,20+payloadlen);
-len=sizeof(sll);
-bzero(&sll,len);
-sll.sll_family=AF_PACKET;
-sll.sll_ifindex = if_nametoindex("eth0");
-t=sendto(unique_s,packet,14+20+payloadlen, 0,(struct sockaddr *)&sll,len);
-if (t == -1) {perror("sendto failed"); return -1;}
+if(p != NULL) p->len[p->n++] = 14+20+payloadlen;
+else tx_iov[tx_n++].iov_len = 14+20+payloadlen;
+return 0;
 }
 
-#define MAX_ARP 200
-
-struct arpcacheline {
-unsigned int key; //IP address
-unsigned char mac[6]; //Mac address
-}arpcache[MAX_ARP];
 
 
 #define TCP_PROTO 6
-#define MAX_FD 8
+#ifndef MAX_FD
+#define MAX_FD 8 // override with -DMAX_FD=N: per-packet demux cost does not depend on it
+#endif
 #define TCP_MSS 1400
 // Socket states (file descriptor)
 #define FREE 0
@@ -292,7 +735,17 @@ unsigned char mac[6]; //Mac address
 #define PSH 0x08
 #define ACK 0x10
 #define URG 0x20
-int myerrno;
+// TCP option kinds
+#define TCPOPT_EOL 0
+#define TCPOPT_NOP 1
+#define TCPOPT_MSS 2
+#define TCPOPT_WSCALE 3
+#define TCPOPT_SACK_PERM 4
+#define TCPOPT_SACK 5
+#define TCPOPT_TIMESTAMP 8
+#define TCPOLEN_TSTAMP 12 // NOP NOP kind len TSval TSecr
+#define MAX_OPTLEN 40
+__thread int myerrno; //per application thread, as errno
 
 void myperror(char *message) {;//printf("%s: %s\n",message,strerror(myerrno));
 }
@@ -308,7 +761,7 @@ unsigned char flags;
 unsigned short window;
 unsigned short checksum;
 unsigned short urgp;
-unsigned char payload[TCP_MSS];
+unsigned char payload[MAX_OPTLEN+TCP_MSS];
 };
 /*
                      +--------+--------+--------+--------+
@@ -328,31 +781,112 @@ unsigned char prot;
 unsigned short len;
 };
 
-struct rxcontrol{
-unsigned int stream_offs;
-unsigned int streamsegmentsize;
-struct rxcontrol * next;
+/* Out of order data: received ranges [start, end) of stream offsets beyond
+ * cumulativeack, sorted and disjoint (adjacent ranges are merged). The gaps
+ * between cumulativeack and the ranges are the holes still to be filled. */
+#define RX_MAX_RANGES 64
+struct rxrange{
+unsigned int start, end;
 };
 
+/* Segment descriptor: a slot of the per-TCB txq ring. The payload is not
+ * stored here but in the send ring (tcb->txbuffer) at the stream offset of
+ * seq; the segment is built from both only when it is (re)transmitted. */
 struct txcontrolbuf{
-struct tcp_segment * segment;
+unsigned int seq; //absolute sequence number, host order
 int totlen;
 int payloadlen;
+unsigned short basesum; //checksum of the fields that never change on retransmission, 0 = not computed
+unsigned char flags;
+unsigned char optlen;
+unsigned char sacked; //covered by a SACK block: not to be retransmitted
+unsigned char lost; //marked for retransmission by the SACK scoreboard
+unsigned int tsval; //ts_now() at the last transmission, sent as TSval when timestamps are on
+unsigned char * options;
 long long int txtime;
-struct txcontrolbuf * next;
 int retry;
 };
 
+#ifdef CONGCTRL
+/* Congestion control algorithm of a connection. congctrl_fsm keeps the loss
+ * detection (duplicate acks, fast retransmit and recovery) common to all of
+ * them and asks the algorithm for the window:
+ * on_ack: ack outside recovery, acked = bytes newly acknowledged (may be 0)
+ * on_loss: third duplicate ack, sets ssthreshold (cgwin = ssthreshold + 2 MSS follows)
+ * on_rto: retransmission timeout, sets ssthreshold and cgwin
+ * pacing_rate: bytes per second the sender should not exceed, 0 = no pacing */
+struct tcpctrlblk;
+struct cc_ops{
+char * name;
+void (*init)(struct tcpctrlblk * tcb);
+void (*on_ack)(struct tcpctrlblk * tcb, unsigned int acked);
+void (*on_loss)(struct tcpctrlblk * tcb);
+void (*on_rto)(struct tcpctrlblk * tcb);
+unsigned long long (*pacing_rate)(struct tcpctrlblk * tcb);
+};
+
+struct cubic_state{
+double wmax; //window before the last reduction, in MSS
+double origin, k; //plateau of the cubic curve and its time offset (s)
+double west; //window a Reno flow would have, in MSS
+long long epoch; //tick the current growth period began, 0 = not started
+};
+
+#define BBR_BW_ROUNDS 10
+struct bbr_state{
+double bw[BBR_BW_ROUNDS]; //delivery rate of the last rounds, bytes per tick
+double btlbw; //max of bw[]: bottleneck bandwidth estimate
+double full_bw; //btlbw when it last grew by 25%
+unsigned int minrtt; //us, 0 = no sample yet
+long long minrtt_stamp;
+unsigned int round_end; //absolute seq: the round ends when it is acknowledged
+long long round_start;
+unsigned int round_delivered;
+unsigned int rounds;
+unsigned int delivered;
+unsigned char mode, cycle, full_cnt;
+};
+#endif
+
+/* Ring offset of stream byte rel, one of the last txbufsize written */
+#define TXBUF_OFFS(t,rel) (((t)->txhead + (t)->txbufsize - ((t)->sequence - (rel))) % (t)->txbufsize)
+
+/* Receiver side silly window avoidance (RFC 1122 4.2.3.3): reading opened
+ * the window by a segment or half the buffer past what the peer knows */
+#define WIN_UPDATE(t) ((int)((t)->cumulativeack + (t)->adwin - (t)->adv_edge) >= (int)MIN((t)->rxbufsize/2, (t)->mss))
+
 struct tcpctrlblk{
-struct txcontrolbuf *txfirst, * txlast;
+/* Send side: stream bytes [.., sequence) live in the txbuffer ring,
+ * [snd_nxt, sequence) are not yet cut into segments. txq holds the segment
+ * descriptors in sequence order: live slots are [txq_head, txq_tail),
+ * indices are free running and masked with txq_size-1 (power of 2). */
+unsigned char * txbuffer;
+unsigned int txbufsize;
+unsigned int txhead; //ring offset of stream byte sequence: wraps at txbufsize, not with the 32 bit offsets
+unsigned char txlent; //txbuffer was lent by the application with myregbuf(): not ours to free
+unsigned int snd_nxt;
+unsigned int snd_max; //absolute seq following the highest byte (or SYN/FIN) transmitted
+struct txcontrolbuf * txq;
+unsigned int txq_size, txq_head, txq_tail;
 int st;
 unsigned short r_port;
 unsigned int r_addr;
-unsigned short adwin;
-unsigned short radwin;
+unsigned int adwin; //bytes, advertised >> rcv_wscale
+unsigned int adv_edge; //stream offset of the right edge we last advertised
+unsigned int radwin; //bytes, received << snd_wscale
+unsigned char snd_wscale, rcv_wscale; //RFC 7323 shifts, 0 unless both ends sent the option
+unsigned char synopt[MAX_OPTLEN]; //options of our SYN or SYN-ACK
 unsigned char * rxbuffer;
+unsigned int rxbufsize;
 unsigned int rx_win_start;
-struct rxcontrol * unack;
+unsigned int sack_ok; //both ends sent SACK permitted
+unsigned int rx_last; //stream offset of the latest out of order segment, its range is SACKed first
+unsigned int sack_high; //highest sequence number SACKed by the peer
+unsigned int ts_ok; //RFC 7323 timestamps: offered in our SYN, then both ends sent the option
+unsigned int ts_recent; //TSval to echo as TSecr
+unsigned int ack_pending; //in order bytes received since our last ACK went out
+struct rxrange rxq[RX_MAX_RANGES];
+int rxq_n;
 unsigned int cumulativeack;
 unsigned int ack_offs, seq_offs;
 long long timeout;
@@ -360,18 +894,29 @@ unsigned int sequence;
 unsigned int txfree;
 unsigned int mss;
 unsigned int stream_end;
-unsigned int fsm_timer;
+unsigned char persist_shift; //zero window probe backoff
+unsigned char persist_probe; //persist timer expired: one segment may go past the peer window
+unsigned char ka_probes; //keepalive probes sent without an answer
+struct tcp_counters cnt;
 /* CONG CTRL*/
 #ifdef CONGCTRL
 unsigned int ssthreshold;
-unsigned int rtt_e;
-unsigned int Drtt_e;
+unsigned int rtt_e; //us
+unsigned int Drtt_e; //us
 unsigned int cong_st;
 unsigned int last_ack;
 unsigned int repeated_acks;
 unsigned int flightsize;
 unsigned int cgwin;
 unsigned int lta;
+unsigned int rtt_sample; //latest RTT sample (us), 0 once consumed
+unsigned long long pace_rate; //bytes/s from cc->pacing_rate at the last transmission, 0 = not paced
+long long pace_next; //CLOCK_MONOTONIC ns before which no data segment may leave
+struct cc_ops * cc;
+union{
+        struct cubic_state cubic;
+        struct bbr_state bbr;
+        }ccs;
 #endif
 };
 
@@ -382,8 +927,274 @@ unsigned short l_port;
 unsigned int l_addr;
 struct tcpctrlblk * tcblist; //Backlog listen queue
 int bl; //backlog length;
+int bl_head, bl_count; //FIFO of established connections waiting for myaccept
+int hnext; //next fd in the same demux hash chain (0 = end)
+int rcvbuf; //SO_RCVBUF for the next connection, 0 = RXBUFSIZE
+int keepalive; //SO_KEEPALIVE
+int users; //API calls in progress, blocked ones included: the tcb is not freed under them
+int nodelay; //TCP_NODELAY: no Nagle coalescing
+int cork; //TCP_CORK: only full segments leave until uncorked
+int nonblock; //O_NONBLOCK: EAGAIN instead of waiting
+unsigned int epmask; //myepoll instances watching it, a bit each
+#ifdef CONGCTRL
+int cc; //TCP_CONGESTION: index in cc_algos[] for the next connection
+#endif
+#ifdef SHARDS
+int shard; //worker owning the socket, see shard_of()
+#endif
 }fdinfo[MAX_FD];
 
+/* Demultiplexing tables indexed by hash. Chains hold fd numbers linked through
+ * fdinfo[].hnext; fd 0 is never a socket and terminates a chain.
+ * connhash: connected sockets, keyed by (r_addr, r_port, l_port, l_addr)
+ * listenhash: listening sockets, keyed by l_port */
+#ifndef HASH_BITS
+#define HASH_BITS 12
+#endif
+#define HASH_SIZE (1<<HASH_BITS)
+int connhash[HASH_SIZE];
+int listenhash[HASH_SIZE];
+
+unsigned int conn_hashfn(unsigned int r_addr, unsigned short r_port, unsigned short l_port, unsigned int l_addr){
+return ((r_addr ^ l_addr ^ (((unsigned int)r_port<<16) | l_port)) * 2654435761u) >> (32-HASH_BITS);
+}
+
+unsigned int port_hashfn(unsigned short l_port){
+return ((unsigned int)l_port * 2654435761u) >> (32-HASH_BITS);
+}
+
+void hash_insert(int * table, unsigned int h, int s){
+TABLES_WRLOCK();
+fdinfo[s].hnext = table[h];
+table[h] = s;
+TABLES_UNLOCK();
+}
+
+void hash_remove(int * table, unsigned int h, int s){
+int * p;
+TABLES_WRLOCK();
+for(p = table + h; *p != 0 && *p != s; p = &fdinfo[*p].hnext);
+if(*p == s) *p = fdinfo[s].hnext;
+fdinfo[s].hnext = 0;
+TABLES_UNLOCK();
+}
+
+int conn_lookup(unsigned int r_addr, unsigned short r_port, unsigned short l_port, unsigned int l_addr){
+int s;
+for(s = connhash[conn_hashfn(r_addr,r_port,l_port,l_addr)]; s != 0; s = fdinfo[s].hnext)
+        if((fdinfo[s].l_port == l_port) && (fdinfo[s].tcb->r_port == r_port)
+                && (fdinfo[s].tcb->r_addr == r_addr) && (fdinfo[s].l_addr == l_addr))
+                return s;
+return 0;
+}
+
+/* A listener in SYN_RECEIVED is bound to the peer of the handshake in progress */
+int listen_lookup(unsigned short l_port, unsigned int r_addr, unsigned short r_port){
+int s;
+for(s = listenhash[port_hashfn(l_port)]; s != 0; s = fdinfo[s].hnext)
+        if(fdinfo[s].l_port == l_port){
+                if(fdinfo[s].tcb->st == LISTEN) return s;
+                if((fdinfo[s].tcb->r_port == r_port) && (fdinfo[s].tcb->r_addr == r_addr)) return s;
+        }
+return 0;
+}
+
+/* Hierarchical timing wheel, one tick = TIMER_USECS. Level l has TW_SLOTS
+ * slots of 2^(l*TW_BITS) ticks each; a timer sits in the slot of its expiry
+ * at the lowest level that can still tell it apart from now, and moves down
+ * when the slot above is reached. Arm and cancel are O(1) list operations.
+ * Timers are per fd (not in the tcb, which is copied on accept). */
+#define TW_BITS 8
+#define TW_SLOTS (1<<TW_BITS)
+#define TW_LEVELS 3 // up to 2^24 ticks ahead (2.3 hours)
+#define TW_RTO 0 // oldest unacked segment due for retransmission
+#define TW_FSM 1 // TIME_WAIT expiry
+#define TW_PERSIST 2 // zero window probe
+#define TW_KEEPALIVE 3
+#define TW_DELACK 4 // data received and not acknowledged yet
+#define TW_KINDS 5
+#define DELACK_TICKS (40000/TIMER_USECS) // 40 ms
+#define KEEPALIVE_IDLE (7200LL*1000000/TIMER_USECS)
+#define KEEPALIVE_INTVL (75LL*1000000/TIMER_USECS)
+#define KEEPALIVE_PROBES 9
+struct tw_timer{
+struct tw_timer * next, ** pprev; //pprev == NULL: not armed
+long long expire;
+};
+SHARD_LOCAL struct tw_timer * wheel[TW_LEVELS][TW_SLOTS];
+struct tw_timer tw_timers[MAX_FD][TW_KINDS];
+SHARD_LOCAL long long wheel_now; //last tick whose slot has been run
+#define TW(s,kind) (&tw_timers[s][kind])
+#define TW_ARMED(s,kind) (tw_timers[s][kind].pprev != NULL)
+
+void tw_cancel(struct tw_timer * t){
+if(t->pprev == NULL) return;
+if(t->next) t->next->pprev = t->pprev;
+*t->pprev = t->next;
+t->pprev = NULL;
+}
+
+/* The level is the lowest one whose current block (relative to the next slot
+ * to run) also holds expire. Timers beyond the top level simply come round
+ * again at each pass of their top level slot. */
+void tw_arm(struct tw_timer * t, long long expire){
+struct tw_timer ** slot;
+long long base = wheel_now + 1;
+int l;
+tw_cancel(t);
+if(expire < base) expire = base;
+for(l = 0; l < TW_LEVELS-1 && (expire >> ((l+1)*TW_BITS)) != (base >> ((l+1)*TW_BITS)); l++);
+t->expire = expire;
+slot = &wheel[l][(expire >> (l*TW_BITS)) & (TW_SLOTS-1)];
+t->next = *slot;
+if(t->next) t->next->pprev = &t->next;
+*slot = t;
+t->pprev = slot;
+}
+
+/* Unlinks the whole list of a slot so that it can be walked while the
+ * callbacks arm and cancel timers */
+struct tw_timer * tw_detach(struct tw_timer ** slot, struct tw_timer ** head){
+*head = *slot;
+*slot = NULL;
+if(*head) (*head)->pprev = head;
+return *head;
+}
+
+/* Sockets with transmit work: queued data or control segments, an ACK that
+ * moved the window, an expired RTO. mytimer only visits these. */
+SHARD_LOCAL int txready[MAX_FD], txready_n;
+SHARD_LOCAL unsigned char txready_on[MAX_FD];
+
+#ifdef SHARDS
+/* Shard of a connection: the fanout member its frames are delivered to. Same
+ * hash as fanout_prog, on the fields of an incoming frame (host order). */
+int shard_of(unsigned int r_addr, unsigned short r_port, unsigned int l_addr, unsigned short l_port){
+unsigned int h = ntohl(r_addr) ^ ntohl(l_addr) ^ ((unsigned int)ntohs(r_port) << 16 | ntohs(l_port));
+return ((h ^ (h >> 16)) & 0xFFFF) % NSHARDS;
+}
+
+struct sock_filter fanout_code[] = {
+        BPF_STMT(BPF_LD|BPF_W|BPF_ABS, SKF_AD_OFF + SKF_AD_PROTOCOL),
+        BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, 0x0800, 0, 19),
+        BPF_STMT(BPF_LD|BPF_B|BPF_ABS, SKF_NET_OFF + 9), //protocol
+        BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, TCP_PROTO, 0, 17),
+        BPF_STMT(BPF_LD|BPF_H|BPF_ABS, SKF_NET_OFF + 6),
+        BPF_JUMP(BPF_JMP|BPF_JSET|BPF_K, 0x1FFF, 15, 0), //fragment without ports
+        BPF_STMT(BPF_LD|BPF_W|BPF_ABS, SKF_NET_OFF + 12),
+        BPF_STMT(BPF_MISC|BPF_TAX, 0),
+        BPF_STMT(BPF_LD|BPF_W|BPF_ABS, SKF_NET_OFF + 16),
+        BPF_STMT(BPF_ALU|BPF_XOR|BPF_X, 0),
+        BPF_STMT(BPF_ST, 0), //M[0] = saddr ^ daddr
+        BPF_STMT(BPF_LDX|BPF_B|BPF_MSH, SKF_NET_OFF), //X = IP header length
+        BPF_STMT(BPF_LD|BPF_W|BPF_IND, SKF_NET_OFF), //source and destination port
+        BPF_STMT(BPF_LDX|BPF_MEM, 0),
+        BPF_STMT(BPF_ALU|BPF_XOR|BPF_X, 0),
+        BPF_STMT(BPF_ST, 0),
+        BPF_STMT(BPF_ALU|BPF_RSH|BPF_K, 16),
+        BPF_STMT(BPF_LDX|BPF_MEM, 0),
+        BPF_STMT(BPF_ALU|BPF_XOR|BPF_X, 0),
+        BPF_STMT(BPF_ALU|BPF_AND|BPF_K, 0xFFFF),
+        BPF_STMT(BPF_RET|BPF_A, 0), //the kernel takes it modulo the members
+        BPF_STMT(BPF_RET|BPF_K, 0), //ARP and the rest: shard 0
+};
+struct sock_fprog fanout_prog = { sizeof(fanout_code)/sizeof(fanout_code[0]), fanout_code };
+int shard_sock[NSHARDS];
+unsigned char * shard_ring[NSHARDS];
+
+/* Cross-shard handoff. A worker only runs the connections it owns: frames the
+ * fanout gave to another member (those of a listener, which lives on one
+ * shard) are copied into the owner's frame ring, bounded and lock-free for any
+ * number of producers (each slot holds the position it can next be written or
+ * read at). What the application asks of a socket on the owner's wheel or
+ * ready list is a bit in handoff_ops[] plus the fd pushed on the owner's op
+ * stack, which the owner takes as a whole. */
+#define HANDOFF_SLOTS 256
+#define HANDOFF_FRAME 2048 // larger frames are dropped: the sender retransmits
+#define HO_KICK 1
+#define HO_KEEPALIVE 2
+#define HO_ACK 4
+struct handoff_slot{
+unsigned long seq;
+int size;
+unsigned char frame[HANDOFF_FRAME];
+};
+struct handoff{
+struct handoff_slot slot[HANDOFF_SLOTS];
+unsigned long head; //next position a producer claims
+unsigned long tail; //next position the owner reads
+int ops; //top of the op stack, 0 = empty
+int efd; //eventfd in the owner's epoll set
+}handoff[NSHARDS];
+int handoff_next[MAX_FD];
+unsigned char handoff_ops[MAX_FD];
+
+void handoff_wake(int k){
+unsigned long long one = 1;
+if(write(handoff[k].efd, &one, sizeof(one)) == -1) perror("handoff eventfd");
+}
+
+int handoff_frame(int k, unsigned char * frame, int size){
+struct handoff * h = &handoff[k];
+struct handoff_slot * sl;
+unsigned long pos = __atomic_load_n(&h->head, __ATOMIC_RELAXED);
+long d;
+if(size > HANDOFF_FRAME) return -1;
+for(;;){
+        sl = &h->slot[pos % HANDOFF_SLOTS];
+        d = (long)(__atomic_load_n(&sl->seq, __ATOMIC_ACQUIRE) - pos);
+        if(d < 0) return -1; //full
+        if(d > 0) pos = __atomic_load_n(&h->head, __ATOMIC_RELAXED); //taken by another producer
+        else if(__atomic_compare_exchange_n(&h->head, &pos, pos+1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) break;
+        }
+memcpy(sl->frame, frame, size);
+sl->size = size;
+__atomic_store_n(&sl->seq, pos+1, __ATOMIC_RELEASE);
+handoff_wake(k);
+return 0;
+}
+
+void handoff_op(int s, int op){
+struct handoff * h = &handoff[fdinfo[s].shard];
+int top;
+if(__atomic_fetch_or(&handoff_ops[s], op, __ATOMIC_ACQ_REL)) return; //already on the stack
+top = __atomic_load_n(&h->ops, __ATOMIC_RELAXED);
+do handoff_next[s] = top;
+while(!__atomic_compare_exchange_n(&h->ops, &top, s, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+handoff_wake(fdinfo[s].shard);
+}
+#endif
+
+void tx_kick(int s){
+#ifdef SHARDS
+if(!is_worker){ handoff_op(s, HO_KICK); return;} //the ready list is the owner's
+#endif
+if(txready_on[s]) return;
+txready_on[s] = 1;
+txready[txready_n++] = s;
+}
+
+/* SO_KEEPALIVE set or cleared, connection accepted */
+void keepalive_arm(int s){
+#ifdef SHARDS
+if(!is_worker){ handoff_op(s, HO_KEEPALIVE); return;} //the timer goes on the owner's wheel
+#endif
+if(!fdinfo[s].keepalive) tw_cancel(TW(s,TW_KEEPALIVE));
+else if(fdinfo[s].st == TCB_CREATED && fdinfo[s].tcb->st == ESTABLISHED) tw_arm(TW(s,TW_KEEPALIVE), tick + KEEPALIVE_IDLE);
+}
+
+#ifdef CONGCTRL
+/* Sockets waiting for their pacing time, see pace_ok() */
+SHARD_LOCAL int pace_heap[MAX_FD], pace_n;
+int pace_pos[MAX_FD]; //index in pace_heap + 1, 0 = not queued
+SHARD_LOCAL long long pace_armed; //deadline the pacing timer is set to, 0 = disarmed
+#ifdef EVLOOP
+SHARD_LOCAL int pfd;
+#else
+timer_t pacetimer;
+#endif
+void pace_cancel(int s);
+#endif
 
 /* Congestion Control Parameters*/
 #define ALPHA 1
@@ -394,24 +1205,315 @@ int bl; //backlog length;
 #define FAST_RECOV 2
 #define INIT_CGWIN 1//in MSS
 #define INIT_THRESH 8 //in MSS
+#ifndef TCP_CONGESTION
+#define TCP_CONGESTION 13 // as in <netinet/tcp.h>, whose TCP_MSS clashes with ours
+#endif
+
+#define TXQ_AT(t,k) (&(t)->txq[(k) & ((t)->txq_size-1)])
+#define TXQ_EMPTY(t) ((t)->txq_head == (t)->txq_tail)
+#define TX_IDLE(t) (TXQ_EMPTY(t) && ((t)->snd_nxt == (t)->sequence)) //nothing queued nor waiting to be segmented
+#ifndef TCP_NODELAY
+#define TCP_NODELAY 1
+#define TCP_CORK 3
+#endif
+
+/* Returns the first option of the given kind in the header of tcp (len set to its length), or NULL */
+unsigned char * tcp_option(struct tcp_segment * tcp, unsigned char kind, int * len){
+unsigned char * o = tcp->payload;
+unsigned char * end = ((unsigned char *) tcp) + (tcp->d_offs_res>>4)*4;
+while(o < end && *o != TCPOPT_EOL){
+        if(*o == TCPOPT_NOP) { o++; continue; }
+        if((o+1 >= end) || (o[1] < 2) || (o + o[1] > end)) break;
+        if(*o == kind) { *len = o[1]; return o; }
+        o += o[1];
+        }
+return NULL;
+}
+
+/* Writes a SACK option with the received ranges, the one holding the latest segment
+ * first (RFC 2018). Returns its length, 0 if there is nothing to report. */
+int sack_fill(struct tcpctrlblk * t, unsigned char * o, int room){
+int n = MIN(3, MIN(t->rxq_n, (room-4)/8));
+int first, b, k, idx[3];
+unsigned int edge;
+if(n <= 0) return 0;
+for(first = 0; first < t->rxq_n && !((t->rxq[first].start <= t->rx_last) && (t->rx_last < t->rxq[first].end)); first++);
+if(first == t->rxq_n) first = 0;
+idx[0] = first;
+for(k = 0, b = 1; b < n; k++)
+        if(k != first) idx[b++] = k;
+o[0] = TCPOPT_NOP; o[1] = TCPOPT_NOP;
+o[2] = TCPOPT_SACK; o[3] = 2 + 8*n;
+for(b = 0; b < n; b++){
+        edge = htonl(t->ack_offs + t->rxq[idx[b]].start); memcpy(o + 4 + 8*b, &edge, 4);
+        edge = htonl(t->ack_offs + t->rxq[idx[b]].end); memcpy(o + 8 + 8*b, &edge, 4);
+        }
+return 4 + 8*n;
+}
+
+/* Sender scoreboard: marks the segments covered by the SACK blocks of an incoming ACK */
+void sack_update(struct tcpctrlblk * tcb, struct tcp_segment * tcp){
+unsigned char * o;
+int len, b;
+unsigned int start, end, lo, hi, mid;
+if(!tcb->sack_ok || (o = tcp_option(tcp, TCPOPT_SACK, &len)) == NULL) return;
+for(b = 0; b < (len-2)/8; b++){
+        memcpy(&start, o + 2 + 8*b, 4); start = ntohl(start);
+        memcpy(&end, o + 6 + 8*b, 4); end = ntohl(end);
+        for(lo = tcb->txq_head, hi = tcb->txq_tail; lo < hi; ) { // first segment at or after start
+                mid = lo + (hi - lo)/2;
+                if((int)(TXQ_AT(tcb,mid)->seq - start) < 0) lo = mid + 1;
+                else hi = mid;
+                }
+        for( ; lo != tcb->txq_tail && (int)(end - (TXQ_AT(tcb,lo)->seq + TXQ_AT(tcb,lo)->payloadlen)) >= 0; lo++)
+                if(TXQ_AT(tcb,lo)->payloadlen) TXQ_AT(tcb,lo)->sacked = 1;
+        if((int)(end - tcb->sack_high) > 0) tcb->sack_high = end;
+        }
+}
+
+/* Schedules the immediate retransmission of every hole below the highest SACKed byte.
+ * Returns the number of segments marked. */
+int sack_mark_lost(struct tcpctrlblk * tcb){
+unsigned int k;
+int n = 0;
+struct txcontrolbuf * txcb;
+if(!tcb->sack_ok) return 0;
+for(k = tcb->txq_head; k != tcb->txq_tail; k++){
+        txcb = TXQ_AT(tcb,k);
+        if((int)(txcb->seq - tcb->sack_high) >= 0) break;
+        if(!txcb->sacked && !txcb->lost && txcb->retry){
+                txcb->lost = 1;
+                txcb->txtime = 0; //immediate retransmission
+                n++;
+                }
+        }
+return n;
+}
 
 #ifdef CONGCTRL
-void congctrl_fsm(struct tcpctrlblk * tcb, int event, struct tcp_segment * tcp,int streamsegmentsize){
+#define CC_IW 10 //initial window of CUBIC and BBR in MSS, RFC 6928
+#define TICKS_PER_SEC (1000000/TIMER_USECS)
 
-if(event == PKT_RCV){
-                                                printf(" ACK: %d last ACK: %d\n",htonl(tcp->ack)-tcb->seq_offs, htonl(tcb->last_ack)-tcb->seq_offs);
-        switch( tcb->cong_st ){
+/* Windows grow on cgwin / RTT: 2x that in slow start, 1.2x afterwards */
+unsigned long long cwnd_pacing_rate(struct tcpctrlblk * tcb){
+if(tcb->rtt_e == 0) return 0;
+return (unsigned long long) tcb->cgwin * 1000000 / tcb->rtt_e * ((tcb->cong_st == SLOW_START) ? 20 : 12) / 10;
+}
 
-        case SLOW_START :
+/* Reno: the original congctrl_fsm behaviour */
+void reno_init(struct tcpctrlblk * tcb){
+tcb->ssthreshold = INIT_THRESH * tcb->mss;
+tcb->cgwin = INIT_CGWIN * tcb->mss;
+}
+
+void reno_on_ack(struct tcpctrlblk * tcb, unsigned int acked){
+if(tcb->cong_st == SLOW_START)
         // when GRO is active tcb->cgwin += (htonl(tcp->ack)-htonl(tcb->last_ack));
-                tcb->cgwin += tcb->mss;
-                if(tcb->cgwin > tcb->ssthreshold) {
-                                        tcb->cong_st = CONG_AVOID;
-                                        printf(" SLOW START->CONG AVOID\n");
-                                        tcb->repeated_acks = 0;
+        tcb->cgwin += tcb->mss;
+else {
+        // when GRO is active tcb->cgwin += (htonl(tcb->last_ack)-htonl(tcp->ack))*(htonl(tcb->last_ack)-htonl(tcp->ack))/tcb->cgw
+        tcb->cgwin += (tcb->mss)*(tcb->mss)/tcb->cgwin;
+        if (tcb->cgwin<tcb->mss) tcb->cgwin = tcb->mss;
+        }
+}
+
+/*
+ 2.  When the third duplicate ACK is received, a TCP MUST set ssthresh to no more than the value given in equation (4).  When [RFC3042]
+     is in use, additional data sent in limited transmit MUST NOT be included in this calculation.
+                                                                        ssthresh = max (FlightSize / 2, 2*SMSS)            (4)
+*/
+void reno_on_loss(struct tcpctrlblk * tcb){
+tcb->ssthreshold = MAX(tcb->flightsize/2,2*tcb->mss);
+}
+
+void reno_on_rto(struct tcpctrlblk * tcb){
+if(tcb->cong_st == CONG_AVOID) tcb->ssthreshold= MAX(tcb->flightsize/2,2*tcb->mss);
+if(tcb->cong_st == FAST_RECOV) tcb->ssthreshold=MAX(tcb->mss,tcb->ssthreshold/2);
+if(tcb->cong_st == SLOW_START) tcb->ssthreshold=MAX(tcb->mss,tcb->ssthreshold/2);
+tcb->cgwin = INIT_CGWIN* tcb->mss;
+}
+
+/* CUBIC, RFC 9438. Windows in MSS, time in seconds */
+#define CUBIC_C 0.4
+#define CUBIC_BETA 0.7
+
+double cc_cbrt(double x){
+double r = (x > 1) ? x/3 : 1;
+int i;
+if(x <= 0) return 0;
+for(i=0;i<40;i++) r = (2*r + x/(r*r))/3; //Newton
+return r;
+}
+
+void cubic_init(struct tcpctrlblk * tcb){
+bzero(&tcb->ccs.cubic, sizeof(struct cubic_state));
+tcb->ssthreshold = 0x7FFFFFFF; //slow start until the first loss
+tcb->cgwin = CC_IW * tcb->mss;
+}
+
+void cubic_on_ack(struct tcpctrlblk * tcb, unsigned int acked){
+struct cubic_state * c = &tcb->ccs.cubic;
+double cwnd = tcb->cgwin / (double) tcb->mss, t, target;
+if(tcb->cong_st == SLOW_START){
+        tcb->cgwin += MIN(acked, 2*tcb->mss); //RFC 3465 with L = 2
+        return;
+        }
+if(c->epoch == 0){
+        c->epoch = tick;
+        if(cwnd < c->wmax){
+                c->k = cc_cbrt((c->wmax - cwnd)/CUBIC_C);
+                c->origin = c->wmax;
+                }
+        else {
+                c->k = 0;
+                c->origin = cwnd;
+                }
+        c->west = cwnd;
+        }
+t = (tick - c->epoch) / (double) TICKS_PER_SEC + tcb->rtt_e / 1e6; //where the window should be one RTT from now
+target = CUBIC_C*(t - c->k)*(t - c->k)*(t - c->k) + c->origin;
+c->west += 3*(1-CUBIC_BETA)/(1+CUBIC_BETA) * acked / (double) tcb->cgwin;
+if(c->west > target) target = c->west; //Reno friendly region
+if(target > 1.5*cwnd) target = 1.5*cwnd;
+if(target > cwnd)
+        tcb->cgwin += tcb->mss * (target - cwnd) / cwnd;
+else
+        tcb->cgwin += tcb->mss / (100*cwnd) + 1;
+}
+
+void cubic_on_loss(struct tcpctrlblk * tcb){
+struct cubic_state * c = &tcb->ccs.cubic;
+double cwnd = tcb->cgwin / (double) tcb->mss;
+c->wmax = (cwnd < c->wmax) ? cwnd*(1+CUBIC_BETA)/2 : cwnd; //fast convergence
+c->epoch = 0;
+tcb->ssthreshold = MAX(tcb->cgwin*CUBIC_BETA, 2*tcb->mss);
+}
+
+void cubic_on_rto(struct tcpctrlblk * tcb){
+cubic_on_loss(tcb);
+tcb->cgwin = tcb->mss;
+}
+
+/* BBR-style: the window follows a model of the path, bottleneck bandwidth
+ * (max delivery rate over the last rounds) times min RTT, instead of loss.
+ * STARTUP doubles the rate each round until it stops growing, DRAIN empties
+ * the queue built meanwhile, PROBE_BW cycles the pacing gain around 1.
+ * There is no PROBE_RTT state: a min RTT older than BBR_MINRTT_WIN is simply
+ * replaced by the next sample. */
+#define BBR_STARTUP 0
+#define BBR_DRAIN 1
+#define BBR_PROBE_BW 2
+#define BBR_HIGH_GAIN 2.885
+#define BBR_CWND_GAIN 2
+#define BBR_MINRTT_WIN (10*TICKS_PER_SEC)
+double bbr_cycle_gain[8] = { 1.25, 0.75, 1, 1, 1, 1, 1, 1 };
+
+double bbr_pacing_gain(struct bbr_state * b){
+if(b->mode == BBR_STARTUP) return BBR_HIGH_GAIN;
+if(b->mode == BBR_DRAIN) return 1/BBR_HIGH_GAIN;
+return bbr_cycle_gain[b->cycle];
+}
+
+void bbr_init(struct tcpctrlblk * tcb){
+bzero(&tcb->ccs.bbr, sizeof(struct bbr_state));
+tcb->ccs.bbr.round_end = tcb->seq_offs;
+tcb->ccs.bbr.round_start = tick;
+tcb->ssthreshold = 0; //no slow start: the model sets the window
+tcb->cgwin = CC_IW * tcb->mss;
+}
+
+void bbr_on_ack(struct tcpctrlblk * tcb, unsigned int acked){
+struct bbr_state * b = &tcb->ccs.bbr;
+unsigned int target;
+unsigned int ack = ntohl(tcb->last_ack) + acked; //this ACK: congctrl_fsm moves last_ack after the hook
+int k;
+b->delivered += acked;
+b->round_delivered += acked;
+if(tcb->rtt_sample){
+        if(b->minrtt == 0 || tcb->rtt_sample <= b->minrtt || tick - b->minrtt_stamp > BBR_MINRTT_WIN){
+                b->minrtt = tcb->rtt_sample;
+                b->minrtt_stamp = tick;
+                }
+        tcb->rtt_sample = 0;
+        }
+if((int)(ack - b->round_end) >= 0 && tick > b->round_start){ //round trip completed
+        b->bw[b->rounds++ % BBR_BW_ROUNDS] = b->round_delivered / (double)(tick - b->round_start);
+        for(b->btlbw = 0, k=0; k<BBR_BW_ROUNDS; k++) b->btlbw = MAX(b->btlbw, b->bw[k]);
+        b->round_end = tcb->seq_offs + tcb->snd_nxt;
+        b->round_start = tick;
+        b->round_delivered = 0;
+        if(b->mode == BBR_STARTUP){
+                if(b->btlbw >= 1.25*b->full_bw){ b->full_bw = b->btlbw; b->full_cnt = 0;}
+                else if(++b->full_cnt == 3){ b->mode = BBR_DRAIN; LOG_TRACE(" BBR STARTUP->DRAIN\n");}
+                }
+        else if(b->mode == BBR_PROBE_BW)
+                b->cycle = (b->cycle + 1) % 8;
         }
-        break;
+if(b->btlbw == 0 || b->minrtt == 0){ //no model yet
+        tcb->cgwin += acked;
+        return;
+        }
+target = MAX(BBR_CWND_GAIN * b->btlbw * b->minrtt / TIMER_USECS, 4*tcb->mss);
+if(b->mode == BBR_DRAIN && tcb->flightsize <= b->btlbw * b->minrtt / TIMER_USECS){
+        b->mode = BBR_PROBE_BW;
+        b->cycle = rand() % 8;
+        LOG_TRACE(" BBR DRAIN->PROBE_BW\n");
+        }
+if(b->mode == BBR_STARTUP)
+        tcb->cgwin = (tcb->cgwin < target) ? tcb->cgwin + acked : tcb->cgwin;
+else
+        tcb->cgwin = MIN(tcb->cgwin + acked, target);
+}
 
+void bbr_on_loss(struct tcpctrlblk * tcb){
+tcb->ssthreshold = tcb->cgwin; //loss is not a congestion signal: recovery ends at the same window
+}
+
+void bbr_on_rto(struct tcpctrlblk * tcb){
+tcb->ssthreshold = 0;
+tcb->cgwin = tcb->mss; //grows back to the model on the next acks
+}
+
+unsigned long long bbr_pacing_rate(struct tcpctrlblk * tcb){
+struct bbr_state * b = &tcb->ccs.bbr;
+if(b->btlbw == 0) return cwnd_pacing_rate(tcb);
+return bbr_pacing_gain(b) * b->btlbw * TICKS_PER_SEC;
+}
+
+struct cc_ops cc_algos[] = {
+{ "reno", reno_init, reno_on_ack, reno_on_loss, reno_on_rto, cwnd_pacing_rate },
+{ "cubic", cubic_init, cubic_on_ack, cubic_on_loss, cubic_on_rto, cwnd_pacing_rate },
+{ "bbr", bbr_init, bbr_on_ack, bbr_on_loss, bbr_on_rto, bbr_pacing_rate },
+};
+#define CC_N (sizeof(cc_algos)/sizeof(struct cc_ops))
+#ifndef CC_DEFAULT
+#define CC_DEFAULT 0 // reno
+#endif
+
+void congctrl_init(struct tcpctrlblk * tcb, int cc){
+tcb->cc = &cc_algos[cc];
+tcb->timeout = INIT_TIMEOUT;
+tcb->rtt_e = 0;
+tcb->Drtt_e = 0;
+tcb->rtt_sample = 0;
+tcb->pace_rate = tcb->pace_next = 0;
+tcb->flightsize = 0;
+tcb->repeated_acks = 0;
+tcb->lta = 0;
+tcb->last_ack = htonl(tcb->seq_offs);
+tcb->cong_st = SLOW_START;
+tcb->cc->init(tcb);
+}
+
+void congctrl_fsm(int s, struct tcpctrlblk * tcb, int event, struct tcp_segment * tcp,int streamsegmentsize){
+unsigned int acked;
+unsigned int cwnd0 = tcb->cgwin, ssthresh0 = tcb->ssthreshold;
+if(event == PKT_RCV){
+                                                LOG_TRACE(" ACK: %d last ACK: %d\n",htonl(tcp->ack)-tcb->seq_offs, htonl(tcb->last_ack)-tcb->seq_offs);
+        acked = ((int)(ntohl(tcp->ack) - ntohl(tcb->last_ack)) > 0) ? ntohl(tcp->ack) - ntohl(tcb->last_ack) : 0;
+        switch( tcb->cong_st ){
+
+        case SLOW_START :
         case CONG_AVOID:
  /*
 RFC 5681 page 9:
@@ -421,43 +1523,43 @@ RFC 5681 page 9:
      TCP sender MUST NOT change cwnd to reflect these two segments [RFC3042].
 */
 
-                if((((tcp->flags)&(SYN|FIN))==0) &&  streamsegmentsize==0 && (htons(tcp->window) == tcb->radwin) && (tcp->ack == tcb->last_ack))
-                if( tcp->ack == tcb->last_ack)
+                if((((tcp->flags)&(SYN|FIN))==0) &&  streamsegmentsize==0 && ((htons(tcp->window) << tcb->snd_wscale) == tcb->radwin) && (tcp->ack == tcb->last_ack)){
                                 tcb->repeated_acks++;
+                                TCB_STAT(tcb, dup_acks);
+                                }
+                else if(acked)
+                                tcb->repeated_acks = tcb->lta = 0;
 
-                        printf(" REPEATED ACKS = %d (flags=0x%.2x streamsgmsize=%d, tcp->win=%d radwin=%d tcp->ack=%d tcb->lastack=%d)\n",tcb->repeated_acks,tcp->flags,streamsegmentsize,htons(tcp->window), tcb->radwin,htonl(tcp->ack),htonl(tcb->last_ack));
+                        LOG_TRACE(" REPEATED ACKS = %d (flags=0x%.2x streamsgmsize=%d, tcp->win=%d radwin=%d tcp->ack=%d tcb->lastack=%d)\n",tcb->repeated_acks,tcp->flags,streamsegmentsize,htons(tcp->window), tcb->radwin,htonl(tcp->ack),htonl(tcb->last_ack));
 
                         if((tcb->repeated_acks == 1 ) || ( tcb->repeated_acks == 2)){
                                  if (tcb->flightsize<=tcb->cgwin + 2* (tcb->mss))
                                                 tcb->lta = tcb->repeated_acks+2*tcb->mss; //RFC 3042 Limited Transmit Extra-TX-win;
                         }
-/*
- 2.  When the third duplicate ACK is received, a TCP MUST set ssthresh to no more than the value given in equation (4).  When [RFC3042]
-     is in use, additional data sent in limited transmit MUST NOT be included in this calculation.
-                                                                        ssthresh = max (FlightSize / 2, 2*SMSS)            (4)
-*/
                         else if (tcb->repeated_acks == 3){
-                                printf(" THIRD ACK...\n");
-                                if(tcb->txfirst!= NULL){
-                                        struct txcontrolbuf * txcb;
-                                        tcb->ssthreshold = MAX(tcb->flightsize/2,2*tcb->mss);
+                                LOG_TRACE(" THIRD ACK...\n");
+                                if(!TXQ_EMPTY(tcb)){
+                                        struct txcontrolbuf * txcb = TXQ_AT(tcb,tcb->txq_head);
+                                        tcb->cc->on_loss(tcb);
                                         tcb->cgwin = tcb->ssthreshold + 2*tcb->mss; /* The third increment is in the FAST_RECOV state*/
 /*
  3.  The lost segment starting at SND.UNA MUST be retransmitted and cwnd set to ssthresh plus 3*SMSS.  This artificially "inflates"
        the congestion window by the number of segments (three) that have left the network and which the receiver has buffered. */
 
-                                        unsigned int shifter = MIN(htonl(tcb->txfirst->segment->seq),htonl(tcb->txfirst->segment->ack));
-                                        if(htonl(tcb->txfirst->segment->seq)-shifter <= (htonl(tcp->ack)-shifter))
-                                                                        tcb->txfirst->txtime = 0; //immediate retransmission
-                                        printf(" FAST RETRANSMIT....\n");
+                                        if((int)(htonl(tcp->ack) - txcb->seq) >= 0)
+                                                                        txcb->txtime = 0; //immediate retransmission
+                                        sack_mark_lost(tcb); //with SACK every known hole, not only the first
+                                        LOG_TRACE(" FAST RETRANSMIT....\n");
                                         tcb->cong_st=FAST_RECOV;
-                                        printf(" CONG AVOID-> FAST_RECOVERY\n");
+                                        LOG_TRACE(" CONG AVOID-> FAST_RECOVERY\n");
                                                                         }
                                 }
-                                else {// normal CONG AVOID
-                                                        // when GRO is active tcb->cgwin += (htonl(tcb->last_ack)-htonl(tcp->ack))*(htonl(tcb->last_ack)-htonl(tcp->ack))/tcb->cgw
-                                                         tcb->cgwin += (tcb->mss)*(tcb->mss)/tcb->cgwin;
-                                                   if (tcb->cgwin<tcb->mss) tcb->cgwin = tcb->mss;
+                                else {
+                                        tcb->cc->on_ack(tcb, acked);
+                                        if(tcb->cong_st == SLOW_START && tcb->cgwin > tcb->ssthreshold) {
+                                                tcb->cong_st = CONG_AVOID;
+                                                LOG_TRACE(" SLOW START->CONG AVOID\n");
+                                                }
                                 }
                                                         break;
 
@@ -467,8 +1569,10 @@ RFC 5681 page 9:
        congestion window in order to reflect the additional segment that has left the network.
 */
                                 if(tcb->last_ack==tcp->ack) {
+                                                TCB_STAT(tcb, dup_acks);
+                                                sack_mark_lost(tcb); //new SACK blocks may reveal new holes
                                                 tcb->cgwin += tcb->mss;
-                                                printf(" Increasing congestion window to : %d\n", tcb->cgwin);
+                                                LOG_TRACE(" Increasing congestion window to : %d\n", tcb->cgwin);
                                 }
           else {
 /*
@@ -477,7 +1581,7 @@ RFC 5681 page 9:
 */
                                                 tcb->cgwin = tcb->ssthreshold;
                                                 tcb->cong_st=CONG_AVOID;
-                                                printf("FAST_RECOVERY ---> CONG_AVOID\n");
+                                                LOG_TRACE("FAST_RECOVERY ---> CONG_AVOID\n");
                                           tcb->repeated_acks=0;
                                         }
                                         break;
@@ -485,172 +1589,330 @@ RFC 5681 page 9:
                                                 tcb->last_ack = tcp->ack; //in network order
                 }
         else if (event == TIMEOUT) {
-                                                if(tcb->cong_st == CONG_AVOID) tcb->ssthreshold= MAX(tcb->flightsize/2,2*tcb->mss);
-                                                if(tcb->cong_st == FAST_RECOV) tcb->ssthreshold=MAX(tcb->mss,tcb->ssthreshold/=2);
-                                                if(tcb->cong_st == SLOW_START) tcb->ssthreshold=MAX(tcb->mss,tcb->ssthreshold/=2);
-                                                tcb->cgwin = INIT_CGWIN* tcb->mss;
+                                                tcb->cc->on_rto(tcb);
                                                 tcb->timeout = MIN( MAXRTO, tcb->timeout*2);
                                                 tcb->rtt_e = 0; /* RFC 6298 Note 2 page 6 */
-                                                printf(" TIMEOUT: --->SLOW_START\n");
+                                                LOG_TRACE(" TIMEOUT: --->SLOW_START\n");
                                                 tcb->cong_st = SLOW_START;
                                         }
+if(tcb->cgwin != cwnd0 || tcb->ssthreshold != ssthresh0)
+        TRACE_EV(TR_CWND, s, tcb->cgwin, tcb->ssthreshold, tcb->cong_st, tcb->flightsize);
 }
 
-
-void rtt_estimate(struct tcpctrlblk * tcb, struct txcontrolbuf * node ){
-        if(node->retry==1){ // If not retransmitted
-                int rtt = tick - node->txtime;
-                printf("%.7ld: RTT:%d RTTE:%d DRTTE:%d TIMEOUT:%lld",rtclock(0),rtt*1000/TIMER_USECS,tcb->rtt_e*1000/TIMER_USECS, tcb->Drtt_e*1000/TIMER_USECS,tcb->timeout*1000/TIMER_USECS);
+/* rtt in us: from the TSecr of an ACK that acknowledges new data or, without
+ * timestamps, from the send time of a segment never retransmitted (Karn) */
+void rtt_estimate(int s, struct tcpctrlblk * tcb, int rtt){
+                rtt = MAX(rtt,1);
+                tcb->rtt_sample = rtt;
+                LOG_TRACE("%.7ld: RTT:%d RTTE:%d DRTTE:%d TIMEOUT:%lld",rtclock(0),rtt,tcb->rtt_e, tcb->Drtt_e,tcb->timeout*TIMER_USECS/1000);
                 if (tcb->rtt_e == 0) {
                                 tcb->rtt_e = rtt;
                                 tcb->Drtt_e = rtt/2;
                 }
                 else{
-                        tcb->Drtt_e = ((8-BETA)*tcb->Drtt_e + BETA*abs(rtt-tcb->rtt_e))>>3;
+                        tcb->Drtt_e = ((8-BETA)*tcb->Drtt_e + BETA*abs(rtt-(int)tcb->rtt_e))>>3;
                         tcb->rtt_e = ((8-ALPHA)*tcb->rtt_e + ALPHA*rtt)>>3;
                 }
-                tcb->timeout = MIN(MAX(tcb->rtt_e + KRTO*tcb->Drtt_e,300*1000/TIMER_USECS),MAXRTO);
-                printf("---> RTT:%d RTTE:%d DRTTE:%d TIMEOUT:%lld\n",rtt*1000/TIMER_USECS,tcb->rtt_e*1000/TIMER_USECS, tcb->Drtt_e*1000/TIMER_USECS,tcb->timeout*1000/TIMER_USECS);
-    }
+                tcb->timeout = MIN(MAX((tcb->rtt_e + KRTO*tcb->Drtt_e)/TIMER_USECS,300*1000/TIMER_USECS),MAXRTO);
+                LOG_TRACE("---> RTT:%d RTTE:%d DRTTE:%d TIMEOUT:%lld\n",rtt,tcb->rtt_e, tcb->Drtt_e,tcb->timeout*TIMER_USECS/1000);
+                TRACE_EV(TR_RTT, s, rtt, tcb->rtt_e, tcb->Drtt_e, tcb->timeout*TIMER_USECS);
 }
 
 #endif
 
-int prepare_tcp(int s, unsigned char flags, unsigned char * payload, int payloadlen,unsigned char * options, int optlen){
-struct tcpctrlblk *t = fdinfo[s].tcb;
-struct tcp_segment * tcp;
-struct txcontrolbuf * txcb = (struct txcontrolbuf*) malloc(sizeof( struct txcontrolbuf));
+void tx_init(struct tcpctrlblk * t){
+t->txbufsize = t->txfree = TXBUFSIZE;
+t->txbuffer = (unsigned char *) malloc(t->txbufsize);
+t->txhead = 0;
+t->txlent = 0;
+for(t->txq_size = 64; t->txq_size < 2*(t->txbufsize/TCP_MSS) + 64; t->txq_size <<= 1);
+t->txq = (struct txcontrolbuf *) malloc(t->txq_size * sizeof(struct txcontrolbuf));
+stack_cnt[SHARD_ID].txbuf_bytes += t->txbufsize;
+stack_cnt[SHARD_ID].txq_slots += t->txq_size;
+t->txq_head = t->txq_tail = 0;
+t->snd_nxt = t->sequence;
+t->snd_max = t->seq_offs + t->sequence;
+t->ack_pending = 0;
+t->persist_shift = t->persist_probe = t->ka_probes = 0;
+t->ts_ok = 1; //offered in our SYN, syn_negotiate() decides
+t->ts_recent = 0;
+}
+
+void rx_init(struct tcpctrlblk * t, int rcvbuf){
+t->rxbufsize = (rcvbuf) ? rcvbuf : RXBUFSIZE;
+t->rxbuffer = (unsigned char *) malloc(t->rxbufsize);
+stack_cnt[SHARD_ID].rxbuf_bytes += t->rxbufsize;
+t->adwin = t->adv_edge = t->rxbufsize;
+for(t->rcv_wscale = 0; (t->rxbufsize >> t->rcv_wscale) > 0xFFFF && t->rcv_wscale < 14; t->rcv_wscale++);
+t->snd_wscale = 0;
+t->rx_win_start = 0;
+t->cumulativeack = 0;
+t->rxq_n = 0;
+}
 
-txcb->txtime = -MAXTIMEOUT ;
+/* Options of our SYN (peer == NULL) or of the SYN-ACK answering the peer's SYN:
+ * MSS always, window scale and SACK permitted only if the peer offered them.
+ * The timestamp option is not here: build_tcp adds it to every segment when ts_ok */
+int syn_options(struct tcpctrlblk * t, struct tcp_segment * peer){
+int len, optlen;
+memcpy(t->synopt, mssopt, sizeof(mssopt));
+len = sizeof(mssopt);
+if(peer == NULL || tcp_option(peer, TCPOPT_WSCALE, &optlen) != NULL){
+        t->synopt[len++] = TCPOPT_NOP;
+        t->synopt[len++] = TCPOPT_WSCALE;
+        t->synopt[len++] = 3;
+        t->synopt[len++] = t->rcv_wscale;
+        }
+if(peer == NULL || tcp_option(peer, TCPOPT_SACK_PERM, &optlen) != NULL){
+        t->synopt[len++] = TCPOPT_NOP;
+        t->synopt[len++] = TCPOPT_NOP;
+        t->synopt[len++] = TCPOPT_SACK_PERM;
+        t->synopt[len++] = 2;
+        }
+return len;
+}
+
+/* Applies the options of the peer's SYN or SYN-ACK */
+void syn_negotiate(struct tcpctrlblk * t, struct tcp_segment * peer){
+unsigned char * o;
+int optlen;
+t->sack_ok = (tcp_option(peer, TCPOPT_SACK_PERM, &optlen) != NULL);
+if((o = tcp_option(peer, TCPOPT_TIMESTAMP, &optlen)) != NULL && optlen == 10){
+        t->ts_ok = 1;
+        t->ts_recent = ntohl(*(unsigned int *)(o+2));
+        }
+else t->ts_ok = 0;
+if((o = tcp_option(peer, TCPOPT_WSCALE, &optlen)) != NULL && optlen == 3)
+        t->snd_wscale = MIN(o[2], 14);
+else
+        t->snd_wscale = t->rcv_wscale = 0; //scaling in both directions or in none
+if((o = tcp_option(peer, TCPOPT_MSS, &optlen)) != NULL && optlen == 4)
+        t->mss = MIN(TCP_MSS, (o[2]<<8) | o[3]);
+}
+
+/* Appends a segment descriptor starting at snd_nxt, NULL if the ring is full */
+struct txcontrolbuf * tx_cut(struct tcpctrlblk * t, unsigned char flags, int payloadlen, unsigned char * options, int optlen){
+struct txcontrolbuf * txcb;
+if(t->txq_tail - t->txq_head == t->txq_size) return NULL;
+txcb = TXQ_AT(t, t->txq_tail++);
+txcb->seq = t->seq_offs + t->snd_nxt;
 txcb->payloadlen = payloadlen;
-txcb->totlen = payloadlen + 20+optlen;
+txcb->totlen = payloadlen + 20 + optlen;
+txcb->flags = flags;
+txcb->options = options;
+txcb->optlen = optlen;
+txcb->txtime = -MAXTIMEOUT;
 txcb->retry = 0;
-tcp = txcb->segment = (struct tcp_segment *) malloc(sizeof(struct tcp_segment));
+txcb->sacked = txcb->lost = 0;
+txcb->basesum = 0;
+t->snd_nxt += payloadlen;
+LOG_TRACE("%.7ld: Packet seq inserted %d:%d\n",rtclock(0),t->snd_nxt-payloadlen, t->snd_nxt);
+return txcb;
+}
 
-tcp->s_port = fdinfo[s].l_port ;
-tcp->d_port = t->r_port;
+/* Cuts the next MSS of written but not yet segmented data */
+struct txcontrolbuf * tx_cut_data(struct tcpctrlblk * t){
+if(t->snd_nxt == t->sequence) return NULL;
+return tx_cut(t, ACK, MIN(t->mss, t->sequence - t->snd_nxt), NULL, 0);
+}
+
+/* Write coalescing: a tail shorter than mss stays in the send ring while
+ * corked, or (Nagle) while some data is still waiting for its ACK. */
+int tx_hold(int s){
+struct tcpctrlblk * t = fdinfo[s].tcb;
+if(t->sequence - t->snd_nxt >= t->mss) return 0;
+if(fdinfo[s].cork) return 1;
+return !fdinfo[s].nodelay && !TXQ_EMPTY(t);
+}
+
+int prepare_tcp(int s, unsigned char flags, unsigned char * payload, int payloadlen,unsigned char * options, int optlen){
+struct tcpctrlblk *t = fdinfo[s].tcb;
 if( t->r_port == 0 )
         ;//printf("Illegal Packet...\n");
-tcp->seq = htonl(t->seq_offs+t->sequence);
-tcp->d_offs_res=(5+optlen/4) << 4;
-tcp->flags=flags&0x3F;
-tcp->urgp=0;
-if(options!=NULL)
-        memcpy(tcp->payload,options,optlen);
-if(payload != NULL)
-        memcpy(tcp->payload+(optlen/4)*4,payload,payloadlen);
-txcb->next=NULL;
-if(t->txfirst == NULL) { t->txlast = t->txfirst = txcb;}
-else {t->txlast->next = txcb; t->txlast = t->txlast->next; }
-printf("%.7ld: Packet seq inserted %d:%d\n",rtclock(0),t->sequence, t->sequence+payloadlen);
-t->sequence += payloadlen;
-//DEFERRED FIELDS
-//tcp->ack;
-//tcp->window;
-//tcp->checksum=0;
-}
-
-int resolve_mac(unsigned int destip, unsigned char * destmac)
-{
-int len,n,i;
-clock_t start;
-unsigned char pkt[1500];
-struct ethernet_frame *eth;
-struct arp_packet *arp;
-for(i=0;i<MAX_ARP && (arpcache[i].key!=0);i++)
-                if(!memcmp(&arpcache[i].key,&destip,4)) break;
-if(arpcache[i].key){ //If found return
-        memcpy(destmac,arpcache[i].mac,6);
-        return 0; }
-eth = (struct ethernet_frame *) pkt;
-arp = (struct arp_packet *) eth->payload;
-for(i=0;i<6;i++) eth->dstmac[i]=0xff;
-for(i=0;i<6;i++) eth->srcmac[i]=mymac[i];
-eth->type=htons(0x0806);
-arp->htype=htons(1);
-arp->ptype=htons(0x0800);
-arp->hlen=6;
-arp->plen=4;
-arp->op=htons(1);
-for(i=0;i<6;i++) arp->srcmac[i]=mymac[i];
-for(i=0;i<4;i++) arp->srcip[i]=myip[i];
-for(i=0;i<6;i++) arp->dstmac[i]=0;
-for(i=0;i<4;i++) arp->dstip[i]=((unsigned char*) &destip)[i];
-//printbuf(pkt,14+sizeof(struct arp_packet));
-bzero(&sll,sizeof(struct sockaddr_ll));
-sll.sll_family = AF_PACKET;
-sll.sll_ifindex = if_nametoindex("eth0");
-len = sizeof(sll);
-n=sendto(unique_s,pkt,14+sizeof(struct arp_packet), 0,(struct sockaddr *)&sll,len);
-fl--;
-sigset_t tmpmask=mymask;
-if( -1 == sigdelset(&tmpmask, SIGALRM)){perror("Sigaddset");return 1;}
-sigprocmask(SIG_UNBLOCK,&tmpmask,NULL);
-start=clock();
-while(pause()){ //wake up only upon signals
-for(i=0;(i<MAX_ARP) && (arpcache[i].key!=0);i++)
-                if(!memcmp(&arpcache[i].key,&destip,4)) break;
-if(arpcache[i].key){
-                memcpy(destmac,arpcache[i].mac,6);
-                sigprocmask(SIG_BLOCK,&tmpmask,NULL);
-                fl++;
-                return 0;
+if(payload != NULL){ // Stream data: into the send ring, segmented at transmit time
+        unsigned int offs = t->txhead;
+        int first = MIN(payloadlen, t->txbufsize - offs);
+        if(payload != t->txbuffer + offs) // already in place when written through mywbuf()
+                memcpy(t->txbuffer + offs, payload, first);
+        if(payload + first != t->txbuffer)
+                memcpy(t->txbuffer, payload + first, payloadlen - first);
+        t->sequence += payloadlen;
+        t->txhead = (offs + payloadlen) % t->txbufsize;
+        tx_kick(s);
+        return 0;
         }
-if ((clock()-start) > CLOCKS_PER_SEC/100) break;
-        }
-sigprocmask(SIG_BLOCK,&tmpmask,NULL);
-fl++;
-//sigaddset(&mymask,SIGALRM);
-return -1 ; //Not resolved
+while(tx_cut_data(t) != NULL); // a control segment follows every byte already written
+if(tx_cut(t, flags&0x3F, 0, options, optlen) == NULL) return -1;
+tx_kick(s);
+return 0;
 }
 
-void update_tcp_header(int s, struct txcontrolbuf *txctrl){
+/* Sets ack and window and the checksum. The sum of pseudo header, ports, seq,
+ * urgp, the descriptor options and the payload is cached in txctrl->basesum at
+ * the first transmission; a retransmission only adds the fields that may have
+ * changed (RFC 1624): length, data offset and flags, ack, window and SACK.
+ * txctrl == NULL computes the whole sum. */
+void update_tcp_header(int s, struct txcontrolbuf * txctrl, struct tcp_segment * tcp, int totlen){
 struct tcpctrlblk * tcb  = fdinfo[s].tcb;
 struct pseudoheader pseudo;
-pseudo.s_addr = fdinfo[s].l_addr;
-pseudo.d_addr = tcb->r_addr;
-pseudo.zero = 0;
-pseudo.prot = 6;
-pseudo.len = htons(txctrl->totlen);
-txctrl->segment->checksum = htons(0);
-txctrl->segment->ack = htonl(tcb->ack_offs + tcb->cumulativeack);
-txctrl->segment->window = htons(tcb->adwin);
-txctrl->segment->checksum = htons(checksum2((unsigned char*)&pseudo, 12, (unsigned char*) txctrl->segment, txctrl->totlen));
+unsigned long long sum;
+int optlen = (tcp->d_offs_res>>4)*4 - 20;
+int fixedopt = (txctrl == NULL) ? 0 : txctrl->optlen;
+tcp->checksum = htons(0);
+tcp->ack = htonl(tcb->ack_offs + tcb->cumulativeack);
+tcp->window = htons(MIN((tcp->flags&SYN) ? tcb->adwin : (tcb->adwin >> tcb->rcv_wscale), 0xFFFF)); //never scaled in a SYN
+tcb->adv_edge = tcb->cumulativeack + tcb->adwin;
+if(txctrl == NULL || txctrl->basesum == 0){
+        pseudo.s_addr = fdinfo[s].l_addr;
+        pseudo.d_addr = tcb->r_addr;
+        pseudo.zero = 0;
+        pseudo.prot = 6;
+        pseudo.len = 0;
+        sum = csum_add(&pseudo, 12, 0);
+        sum = csum_add(tcp, 8, sum); //ports and seq
+        sum = csum_add(&tcp->urgp, 2, sum);
+        sum = csum_add(tcp->payload, fixedopt, sum);
+        sum = csum_add(tcp->payload + optlen, totlen - 20 - optlen, sum);
+        if(txctrl == NULL) sum = csum_fold(sum);
+        else sum = txctrl->basesum = (csum_fold(sum)) ? csum_fold(sum) : 0xFFFF; //same value in ones' complement, 0 means not computed
+        }
+else sum = txctrl->basesum;
+sum += pseudo.len = htons(totlen);
+sum = csum_add(&tcp->ack, 4, sum);
+sum = csum_add(&tcp->d_offs_res, 2, sum); //data offset and flags
+sum = csum_add(&tcp->window, 2, sum);
+sum = csum_add(tcp->payload + fixedopt, optlen - fixedopt, sum);
+tcp->checksum = (unsigned short) ~csum_fold(sum);
 }
 
+/* Builds the segment described by txcb, payload taken from the send ring.
+ * Options that depend on the current state (timestamps, SACK) are added here: returns the segment length. */
+int build_tcp(int s, struct txcontrolbuf * txcb, struct tcp_segment * tcp){
+struct tcpctrlblk * t = fdinfo[s].tcb;
+int optlen = txcb->optlen;
+tcp->s_port = fdinfo[s].l_port;
+tcp->d_port = t->r_port;
+tcp->seq = htonl(txcb->seq);
+tcp->flags = txcb->flags;
+tcp->urgp = 0;
+if(txcb->optlen)
+        memcpy(tcp->payload, txcb->options, txcb->optlen);
+txcb->tsval = ts_now();
+if(t->ts_ok){
+        unsigned char * o = tcp->payload + optlen;
+        o[0] = TCPOPT_NOP; o[1] = TCPOPT_NOP;
+        o[2] = TCPOPT_TIMESTAMP; o[3] = 10;
+        *(unsigned int *)(o+4) = htonl(txcb->tsval);
+        *(unsigned int *)(o+8) = htonl(t->ts_recent);
+        optlen += TCPOLEN_TSTAMP;
+        }
+if(t->sack_ok && !(txcb->flags&SYN))
+        optlen += sack_fill(t, tcp->payload + optlen, MAX_OPTLEN - optlen);
+tcp->d_offs_res = (5+optlen/4) << 4;
+if(txcb->payloadlen){
+        unsigned int offs = TXBUF_OFFS(t, txcb->seq - t->seq_offs);
+        int first = MIN(txcb->payloadlen, t->txbufsize - offs);
+        memcpy(tcp->payload + optlen, t->txbuffer + offs, first);
+        memcpy(tcp->payload + optlen + first, t->txbuffer, txcb->payloadlen - first);
+        }
+update_tcp_header(s, txcb, tcp, 20 + optlen + txcb->payloadlen);
+t->ack_pending = 0; //acknowledged by this segment
+tw_cancel(TW(s,TW_DELACK));
+return 20 + optlen + txcb->payloadlen;
+}
+
+/* Pure ACKs do not go through txq: they are never retransmitted, so they
+ * are built from a descriptor and a segment allocated once for all. */
+SHARD_LOCAL struct txcontrolbuf ackcb;
+SHARD_LOCAL struct tcp_segment ackseg;
+
+void send_ack(int s, unsigned int seq){
+int seglen;
+ackcb.seq = seq;
+ackcb.flags = ACK;
+ackcb.totlen = 20;
+ackcb.basesum = 0; //seq changes, nothing to cache
+seglen = build_tcp(s, &ackcb, &ackseg);
+send_ip((unsigned char*) &ackseg, (unsigned char*) &fdinfo[s].tcb->r_addr, seglen, TCP_PROTO);
+TCB_STAT(fdinfo[s].tcb, segs_out);
+TRACE_EV(TR_TX, s, seq - fdinfo[s].tcb->seq_offs, ntohl(ackseg.ack) - fdinfo[s].tcb->ack_offs, 0, ACK);
+}
+
+/* Pure ACK from any thread: the template and the TX batch are the owner's */
+void ack_now(int s){
+#ifdef SHARDS
+if(!is_worker){ handoff_op(s, HO_ACK); return;}
+#endif
+send_ack(s, fdinfo[s].tcb->snd_max);
+}
+
+
+/* Descriptors and ports are taken without locks, so that any application
+ * thread may open sockets. A descriptor is claimed by the FREE->TCP_UNBOUND
+ * compare and swap and given back by storing FREE once it is clean. */
+int fd_alloc(){
+int i, st;
+for(i=3; i<MAX_FD; i++){
+        st = FREE;
+        if(fdinfo[i].st == FREE && __atomic_compare_exchange_n(&fdinfo[i].st, &st, TCP_UNBOUND, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+                return i;
+        }
+return -1;
+}
+
+void fd_free(int s){
+struct socket_info clean = { .st = fdinfo[s].st }; //never seen FREE before it is all clean
+fdinfo[s] = clean;
+__atomic_store_n(&fdinfo[s].st, FREE, __ATOMIC_RELEASE);
+}
 
 int mysocket(int family, int type, int proto)
 {
 int i;
-if (( family == AF_INET ) && (type == SOCK_STREAM) && (proto ==0)){
-        for(i=3; i<MAX_FD && fdinfo[i].st!=FREE;i++);
-        if(i==MAX_FD) {myerrno = ENFILE; return -1;}
+struct socket_info clean = { .st = TCP_UNBOUND };
+if (( family == AF_INET ) && ((type & ~SOCK_NONBLOCK) == SOCK_STREAM) && (proto ==0)){
+        i = fd_alloc();
+        if(i == -1) {myerrno = ENFILE; return -1;}
         else {
-                bzero(fdinfo+i, sizeof(struct socket_info));
-                fdinfo[i].st = TCP_UNBOUND;
+                fdinfo[i] = clean;
+                fdinfo[i].nonblock = (type & SOCK_NONBLOCK) != 0;
+#ifdef CONGCTRL
+                fdinfo[i].cc = CC_DEFAULT;
+#endif
                 myerrno = 0;
                 return i;
                 }
 }else {myerrno = EINVAL; return -1; }
 }
 
-int last_port=MIN_PORT;
+int myfcntl(int s, int cmd, int arg){
+if ( s < 3 || s >= MAX_FD || fdinfo[s].st == FREE) { myerrno = EBADF; return -1;}
+if(cmd == F_GETFL) return O_RDWR | (fdinfo[s].nonblock ? O_NONBLOCK : 0);
+if(cmd == F_SETFL){ fdinfo[s].nonblock = (arg & O_NONBLOCK) != 0; return 0;}
+myerrno = EINVAL; return -1;
+}
+
+/* Sockets holding each local port: the bound one plus those accepted on it */
+unsigned short port_refs[1<<16];
+unsigned int last_port=MIN_PORT;
+
 int port_in_use( unsigned short port ){
-int s;
-for ( s=3; s<MAX_FD; s++)
-        if (fdinfo[s].st != FREE && fdinfo[s].st!=TCP_UNBOUND)
-                if(fdinfo[s].l_port == port)
-                        return 1;
-return 0;
+return __atomic_load_n(&port_refs[port], __ATOMIC_RELAXED) != 0;
+}
+
+int port_claim( unsigned short port ){ //0 if somebody holds it
+unsigned short none = 0;
+return __atomic_compare_exchange_n(&port_refs[port], &none, 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
 }
 
 unsigned short int get_free_port()
 {
 unsigned short p;
-for ( p = last_port; p<MAX_PORT && port_in_use(p); p++);
-if (p<MAX_PORT) return last_port=p;
-for ( p = MIN_PORT; p<last_port && port_in_use(p); p++);
-if (p<last_port) return last_port=p;
+int n;
+for(n = 0; n < MAX_PORT - MIN_PORT; n++){ //each caller starts from a different port
+        p = MIN_PORT + __atomic_fetch_add(&last_port, 1, __ATOMIC_RELAXED) % (MAX_PORT - MIN_PORT);
+        if(port_claim(p)) return p;
+        }
 return 0;
 }
 
@@ -659,7 +1921,7 @@ if((addr->sa_family == AF_INET)){
         struct sockaddr_in * a = (struct sockaddr_in*) addr;
         if ( s >= 3 && s<MAX_FD){
                 if(fdinfo[s].st != TCP_UNBOUND){myerrno = EINVAL; return -1;}
-                if(a->sin_port && port_in_use(a->sin_port)) {myerrno = EADDRINUSE; return -1;}
+                if(a->sin_port && !port_claim(a->sin_port)) {myerrno = EADDRINUSE; return -1;}
                 fdinfo[s].l_port = (a->sin_port)?a->sin_port:get_free_port();
                 if(fdinfo[s].l_port == 0 ) {myerrno = ENOMEM; return -1;}
                 fdinfo[s].l_addr = (a->sin_addr.s_addr)?a->sin_addr.s_addr:*(unsigned int*)myip;
@@ -672,39 +1934,287 @@ if((addr->sa_family == AF_INET)){
 else { myerrno = EINVAL; return -1; }
 }
 
+int mysetsockopt(int s, int level, int optname, void * optval, int optlen){
+if ( s < 3 || s >= MAX_FD || fdinfo[s].st == FREE) { myerrno = EBADF; return -1;}
+if((level == SOL_SOCKET) && (optname == SO_RCVBUF)){ //applies to the connections opened afterwards
+        if((optlen < sizeof(int)) || (*(int *)optval <= 0) || (*(int *)optval > MAX_RXBUFSIZE)) { myerrno = EINVAL; return -1;}
+        fdinfo[s].rcvbuf = *(int *) optval;
+        myerrno = 0;
+        return 0;
+        }
+if((level == SOL_SOCKET) && (optname == SO_KEEPALIVE)){
+        if(optlen < sizeof(int)) { myerrno = EINVAL; return -1;}
+        SHARD_ENTER(s);
+        STACK_LOCK();
+        fdinfo[s].keepalive = *(int *) optval;
+        keepalive_arm(s);
+        STACK_UNLOCK();
+        myerrno = 0;
+        return 0;
+        }
+if((level == IPPROTO_TCP) && (optname == TCP_NODELAY || optname == TCP_CORK)){
+        if(optlen < sizeof(int)) { myerrno = EINVAL; return -1;}
+        SHARD_ENTER(s);
+        STACK_LOCK();
+        if(optname == TCP_NODELAY) fdinfo[s].nodelay = *(int *) optval;
+        else fdinfo[s].cork = *(int *) optval;
+        if(fdinfo[s].st == TCB_CREATED) tx_kick(s); //releases what was held back
+        STACK_UNLOCK();
+        myerrno = 0;
+        return 0;
+        }
+#ifdef CONGCTRL
+if((level == IPPROTO_TCP) && (optname == TCP_CONGESTION)){ //applies to the connections opened afterwards
+        int i, len = strnlen((char *) optval, optlen);
+        for(i=0;i<CC_N;i++)
+                if(strlen(cc_algos[i].name) == len && !strncmp(cc_algos[i].name, (char *) optval, len)){
+                        fdinfo[s].cc = i;
+                        myerrno = 0;
+                        return 0;
+                        }
+        myerrno = ENOENT; return -1;
+        }
+#endif
+myerrno = ENOPROTOOPT; return -1;
+}
+
+#ifdef CONGCTRL
+#define TCP_PACING_INFO 0x5041 // private option: struct tcp_pacing_info
+struct tcp_pacing_info{
+unsigned long long rate; //bytes/s, 0 = not paced
+long long next_ns; //CLOCK_MONOTONIC time of the next data segment allowed out
+long long wait_ns; //how long from now, 0 if it may send now
+int queued; //waiting for the pacing timer
+unsigned int cgwin, rtt_e; //what the rate is derived from, rtt_e in us
+char cc[16]; //congestion control algorithm
+};
+#endif
+
+#ifndef TCP_INFO
+#define TCP_INFO 11
+#endif
+struct mytcp_info{ //TCP_INFO: a snapshot of the connection and its counters
+int state; //TCP FSM state
+unsigned int mss;
+unsigned int rto_us;
+unsigned int srtt_us, rttvar_us; //CONGCTRL, else 0
+unsigned int cwnd, ssthresh; //bytes, CONGCTRL, else 0
+unsigned int snd_wnd, rcv_wnd; //peer window and the one we advertise, bytes
+unsigned int unacked; //bytes written and not yet acknowledged
+unsigned int rcv_queued; //bytes waiting for myread()
+unsigned int sndbuf, rcvbuf; //sizes of the send and receive rings
+unsigned int txq_used, txq_size; //segment descriptors in use, of the txq ring
+struct tcp_counters cnt;
+};
+
+int mygetsockopt(int s, int level, int optname, void * optval, int * optlen){
+if ( s < 3 || s >= MAX_FD || fdinfo[s].st == FREE) { myerrno = EBADF; return -1;}
+if((level == IPPROTO_TCP) && (optname == TCP_INFO)){
+        struct mytcp_info * ti = (struct mytcp_info *) optval;
+        struct tcpctrlblk * t;
+        if(*optlen < sizeof(struct mytcp_info)) { myerrno = EINVAL; return -1;}
+        SHARD_ENTER(s);
+        STACK_LOCK();
+        if(fdinfo[s].st != TCB_CREATED) { STACK_UNLOCK(); myerrno = ENOTCONN; return -1;}
+        t = fdinfo[s].tcb;
+        bzero(ti, sizeof(struct mytcp_info));
+        ti->state = t->st;
+        ti->mss = t->mss;
+        ti->rto_us = t->timeout*TIMER_USECS;
+#ifdef CONGCTRL
+        ti->srtt_us = t->rtt_e;
+        ti->rttvar_us = t->Drtt_e;
+        ti->cwnd = t->cgwin;
+        ti->ssthresh = t->ssthreshold;
+#endif
+        ti->snd_wnd = t->radwin;
+        ti->rcv_wnd = t->adwin;
+        ti->unacked = t->txbufsize - t->txfree;
+        ti->rcv_queued = t->cumulativeack - t->rx_win_start;
+        ti->sndbuf = t->txbufsize;
+        ti->rcvbuf = t->rxbufsize;
+        ti->txq_used = t->txq_tail - t->txq_head;
+        ti->txq_size = t->txq_size;
+        ti->cnt = t->cnt;
+        STACK_UNLOCK();
+        *optlen = sizeof(struct mytcp_info);
+        myerrno = 0;
+        return 0;
+        }
+if((level == SOL_SOCKET) && (optname == SO_ERROR)){ //outcome of a non-blocking myconnect
+        if(*optlen < sizeof(int)) { myerrno = EINVAL; return -1;}
+        SHARD_ENTER(s);
+        STACK_LOCK();
+        *(int *) optval = (fdinfo[s].st == TCB_CREATED && fdinfo[s].tcb->st == TCP_CLOSED) ? ECONNREFUSED : 0;
+        STACK_UNLOCK();
+        *optlen = sizeof(int);
+        myerrno = 0;
+        return 0;
+        }
+#ifdef CONGCTRL
+if((level == IPPROTO_TCP) && (optname == TCP_PACING_INFO)){
+        struct tcp_pacing_info * pi = (struct tcp_pacing_info *) optval;
+        struct tcpctrlblk * t;
+        long long now;
+        if(*optlen < sizeof(struct tcp_pacing_info)) { myerrno = EINVAL; return -1;}
+        SHARD_ENTER(s);
+        STACK_LOCK();
+        if(fdinfo[s].st != TCB_CREATED) { STACK_UNLOCK(); myerrno = ENOTCONN; return -1;}
+        t = fdinfo[s].tcb;
+        now = monotonic_ns();
+        pi->rate = t->pace_rate;
+        pi->next_ns = t->pace_next;
+        pi->wait_ns = (t->pace_next > now) ? t->pace_next - now : 0;
+        pi->queued = (pace_pos[s] != 0);
+        pi->cgwin = t->cgwin;
+        pi->rtt_e = t->rtt_e;
+        snprintf(pi->cc, sizeof(pi->cc), "%s", t->cc->name);
+        STACK_UNLOCK();
+        *optlen = sizeof(struct tcp_pacing_info);
+        myerrno = 0;
+        return 0;
+        }
+#endif
+myerrno = ENOPROTOOPT; return -1;
+}
+
+/* Stack totals: the counters of every shard summed up */
+void mystats(struct stack_counters * c){
+struct stack_counters * sh;
+int k, s;
+bzero(c, sizeof(struct stack_counters));
+for(sh = stack_cnt; sh < stack_cnt + NSHARDS; sh++){
+        unsigned long long * from = (unsigned long long *) &sh->tcp, * to = (unsigned long long *) &c->tcp;
+        for(k=0; k<sizeof(struct tcp_counters)/sizeof(unsigned long long); k++) to[k] += from[k];
+        c->arp_misses += sh->arp_misses;
+        c->arp_drops += sh->arp_drops;
+        c->handoff_drops += sh->handoff_drops;
+        c->tx_batches += sh->tx_batches;
+        c->tx_frames += sh->tx_frames;
+        c->arp_pending += sh->arp_pending;
+        c->txbuf_bytes += sh->txbuf_bytes;
+        c->rxbuf_bytes += sh->rxbuf_bytes;
+        c->txq_slots += sh->txq_slots;
+        }
+for(s=3; s<MAX_FD; s++) if(fdinfo[s].st != FREE) c->sockets++;
+}
+
+#ifndef STATS_SECS
+#define STATS_SECS 10 // between two dumps of mystats() at LOG_LEVEL 1 and up, 0 = never
+#endif
+long long stats_next; //tick of the next dump, shard 0 only
+
+void stats_dump(){
+struct stack_counters c;
+mystats(&c);
+LOG_INFO("%.7ld: STATS segs in:%llu out:%llu retrans:%llu (rto:%llu fast:%llu) dupacks:%llu ooo bytes:%llu | arp misses:%llu drops:%llu pending:%d/%d | sockets:%d/%d rings tx:%lldK rx:%lldK txq slots:%lld | tx frames/batch:%.1f handoff drops:%llu\n",
+        rtclock(0), c.tcp.segs_in, c.tcp.segs_out, c.tcp.retrans, c.tcp.rtos, c.tcp.fast_retrans, c.tcp.dup_acks, c.tcp.ooo_bytes,
+        c.arp_misses, c.arp_drops, c.arp_pending, ARP_PENDING, c.sockets, MAX_FD - 3, c.txbuf_bytes >> 10, c.rxbuf_bytes >> 10, c.txq_slots,
+        c.tx_batches ? (double) c.tx_frames / c.tx_batches : 0.0, c.handoff_drops);
+}
+
+/* Bytes myreadv() may hand out now; the FIN takes one sequence number */
+unsigned int rx_avail(struct tcpctrlblk * t){
+unsigned int n = t->cumulativeack - t->rx_win_start;
+if(n > 0 && t->cumulativeack > t->stream_end) n--;
+return n;
+}
+
+/* Nothing more will arrive: myreadv() returns 0 */
+int rx_eof(struct tcpctrlblk * t){
+return (t->rx_win_start && t->rx_win_start == t->stream_end) || (t->st == CLOSE_WAIT && t->rxq_n == 0);
+}
+
+/* Readiness, poll(2) bits, of socket s. Called under its stack lock. */
+int sock_events(int s){
+struct tcpctrlblk * t = fdinfo[s].tcb;
+int ev = 0;
+if(fdinfo[s].st == FREE) return POLLNVAL;
+if(fdinfo[s].st != TCB_CREATED) return POLLHUP; //not connected
+if(fdinfo[s].tcblist != NULL) return fdinfo[s].bl_count ? POLLIN : 0; //listener, whatever st its handshakes left
+if(t->st == TCP_CLOSED) return POLLIN|POLLERR|POLLHUP; //refused or dropped by keepalive
+if(t->st < ESTABLISHED) return 0; //handshake in progress
+if(rx_avail(t) || rx_eof(t)) ev |= POLLIN;
+if(t->st == ESTABLISHED && t->txfree) ev |= POLLOUT;
+return ev;
+}
+
+/* myepoll instances. The interest set (events[], data[] and the bits in
+ * fdinfo[].epmask) is guarded by the stack lock of each socket; the ready
+ * FIFO by the instance lock, taken after the stack lock. sock_wake() queues
+ * a socket whose state may have changed, myepoll_wait() checks it again with
+ * sock_events() and keeps it queued while it stays ready (level triggered). */
+#define MAX_EPOLL 32 // bits in epmask
+struct myepoll{
+int used;
+unsigned int * events; //interest, by fd
+epoll_data_t * data;
+unsigned char * queued; //fd is in ready[]
+int * ready; //FIFO of fds to look at, each at most once
+int ready_head, ready_n;
+#ifdef EVLOOP
+pthread_mutex_t mtx;
+pthread_cond_t cv;
+int waiters;
+#endif
+}eps[MAX_EPOLL];
+
+#ifdef EVLOOP
+#define EP_LOCK(e) pthread_mutex_lock(&(e)->mtx)
+#define EP_UNLOCK(e) pthread_mutex_unlock(&(e)->mtx)
+#else // handlers and application already exclude each other with STACK_LOCK
+#define EP_LOCK(e) STACK_LOCK()
+#define EP_UNLOCK(e) STACK_UNLOCK()
+#endif
+
+void ep_queue(struct myepoll * e, int s){
+if(e->queued[s]) return;
+e->queued[s] = 1;
+e->ready[(e->ready_head + e->ready_n++) % MAX_FD] = s;
+}
+
+void sock_wake(int s){
+unsigned int m;
+int k;
+for(m = fdinfo[s].epmask, k = 0; m; m >>= 1, k++)
+        if(m & 1){
+#ifdef EVLOOP
+                pthread_mutex_lock(&eps[k].mtx);
+                ep_queue(eps+k, s);
+                if(eps[k].waiters) pthread_cond_broadcast(&eps[k].cv);
+                pthread_mutex_unlock(&eps[k].mtx);
+#else
+                ep_queue(eps+k, s);
+#endif
+                }
+}
+
 int fsm(int s, int event, struct ip_datagram * ip)
 {
 struct tcpctrlblk * tcb = fdinfo[s].tcb;
-printf("%.7ld: FSM: Socket: %d Curr-State =%d, Input=%d \n",rtclock(0),s,tcb->st,event);
-struct tcp_segment * tcp;
+int old = tcb->st;
+LOG_TRACE("%.7ld: FSM: Socket: %d Curr-State =%d, Input=%d \n",rtclock(0),s,tcb->st,event);
+struct tcp_segment * tcp = NULL; //PKT_RCV events only
 int i;
 if(ip != NULL)
  tcp = (struct tcp_segment * )((char*)ip+((ip->ver_ihl&0xF)*4));
 switch(tcb->st){
         case TCP_CLOSED:
                 if(event == APP_ACTIVE_OPEN) {
-                        tcb->rxbuffer = (unsigned char*) malloc(RXBUFSIZE);
-                        tcb->txfree = TXBUFSIZE;
+                        rx_init(tcb, fdinfo[s].rcvbuf);
                         tcb->seq_offs=rand();
                         tcb->ack_offs=0;
                         tcb->stream_end=0xFFFFFFFF; //Max file
                         tcb->mss = TCP_MSS;
                         tcb->sequence=0;
-                        tcb->rx_win_start=0;
-                        tcb->cumulativeack =0;
+                        tx_init(tcb);
                         tcb->timeout = INIT_TIMEOUT;
-                        tcb->adwin =RXBUFSIZE;
                         tcb->radwin =RXBUFSIZE;
 
 #ifdef CONGCTRL
-    tcb->ssthreshold = INIT_THRESH * TCP_MSS;
-    tcb->cgwin = INIT_CGWIN* TCP_MSS;
-    tcb->timeout = INIT_TIMEOUT;
-    tcb->rtt_e = 0;
-    tcb->Drtt_e = 0;
-    tcb->cong_st = SLOW_START;
+    congctrl_init(tcb, fdinfo[s].cc);
 #endif
-                        prepare_tcp(s,SYN,NULL,0,mssopt,sizeof(mssopt));
+                        prepare_tcp(s,SYN,NULL,0,tcb->synopt,syn_options(tcb,NULL));
                         tcb->st = SYN_SENT;
 
                 }
@@ -715,10 +2225,10 @@ switch(tcb->st){
                         if((tcp->flags&SYN) && (tcp->flags&ACK) && (htonl(tcp->ack)==tcb->seq_offs + 1)){
                                 tcb->seq_offs ++;
                                 tcb->ack_offs = htonl(tcp->seq) + 1;
-                                free(tcb->txfirst->segment);
-                                free(tcb->txfirst);
-                                tcb->txfirst = tcb->txlast = NULL;
-                                prepare_tcp(s,ACK,NULL,0,NULL,0);
+                                syn_negotiate(tcb, tcp);
+                                tcb->radwin = htons(tcp->window);
+                                tcb->txq_head = tcb->txq_tail; //Remove SYN from TXbuffer
+                                send_ack(s, tcb->snd_max); //not queued: nothing to retransmit
                                 tcb->st = ESTABLISHED;
                                 }
                         }
@@ -745,49 +2255,42 @@ switch(tcb->st){
                         if((event == PKT_RCV) && (tcp->flags&ACK)       ){
                                         if(htonl(tcp->ack) == (tcb->seq_offs + tcb->sequence + 1)){
                                                 tcb->st = TCP_CLOSED;
-                                                tcb->txfirst = tcb->txlast = NULL;
+                                                tcb->txq_head = tcb->txq_tail;
                                 }
                         }
                 break;
 case LISTEN:
   if((event == PKT_RCV) && ((tcp->flags)&SYN)){
-    tcb->rxbuffer=(unsigned char*)malloc(RXBUFSIZE);
+    bzero(&tcb->cnt, sizeof(tcb->cnt)); //the connection being born counts from its SYN
+    tcb->cnt.segs_in = 1;
+    rx_init(tcb, fdinfo[s].rcvbuf);
     tcb->seq_offs=rand();
-    tcb->txfree = TXBUFSIZE; //Dynamic buffer
+    tx_init(tcb); //Dynamic buffer
     tcb->ack_offs=htonl(tcp->seq)+1;
     tcb->r_port = tcp->s_port;
     tcb->r_addr = ip->srcaddr;
-                tcb->rx_win_start=0;
-    tcb->cumulativeack=0;
-    tcb->adwin=RXBUFSIZE;
-    tcb->radwin=RXBUFSIZE;
+    tcb->radwin=htons(tcp->window); //never scaled in a SYN
     tcb->mss=TCP_MSS;
     tcb->timeout = INIT_TIMEOUT;
+    syn_negotiate(tcb, tcp);
 
 #ifdef CONGCTRL
-    tcb->ssthreshold = INIT_THRESH * TCP_MSS;
-    tcb->cgwin = INIT_CGWIN * TCP_MSS;
-    tcb->timeout = INIT_TIMEOUT;
-    tcb->rtt_e = 0;
-    tcb->Drtt_e = 0;
-    tcb->cong_st = SLOW_START;
+    congctrl_init(tcb, fdinfo[s].cc);
 #endif
-    prepare_tcp(s,SYN|ACK,NULL,0,mssopt,sizeof(mssopt));
+    prepare_tcp(s,SYN|ACK,NULL,0,tcb->synopt,syn_options(tcb,tcp));
     tcb->st = SYN_RECEIVED;
     }
     break;
 case SYN_RECEIVED:
   if(((event == PKT_RCV) && ((tcp->flags)&ACK)) &&!((tcp->flags)&SYN)){
     if(htonl(tcp->ack) == tcb->seq_offs + 1){
-                                free(tcb->txfirst->segment);
-      free(tcb->txfirst);
       tcb->seq_offs++;
-      tcb->txfirst = tcb->txlast = NULL; //Remove SYN+ACK from TXbuffer
+      tcb->txq_head = tcb->txq_tail; //Remove SYN+ACK from TXbuffer
       tcb->ack_offs=htonl(tcp->seq);
-      for(i=0;i<fdinfo[s].bl && fdinfo[s].tcblist[i].st!=FREE;i++);
-      if (fdinfo[s].tcblist[i].st!=FREE)
+      if (fdinfo[s].bl_count == fdinfo[s].bl)
             prepare_tcp(s,RST,NULL,0,NULL,0);
         else {
+              i = (fdinfo[s].bl_head + fdinfo[s].bl_count++) % fdinfo[s].bl;
               fdinfo[s].tcblist[i]=*tcb;
               fdinfo[s].tcblist[i].st = ESTABLISHED;
             }
@@ -810,13 +2313,9 @@ case FIN_WAIT_1:
 
 case FIN_WAIT_2:
   if((event == PKT_RCV) && ((tcp->flags)&FIN)){
-                tcb->fsm_timer = tick + tcb->timeout *4;
+                tw_arm(TW(s,TW_FSM), tick + tcb->timeout *4);
     tcb->st = TIME_WAIT;
-        while(tcb->txfirst!=NULL){
-                        struct txcontrolbuf * tmp = tcb->txfirst;
-                        tcb->txfirst = tcb->txfirst->next;
-                        free(tmp);
-                                }
+        tcb->txq_head = tcb->txq_tail;
 }
   break;
 
@@ -824,13 +2323,9 @@ case FIN_WAIT_2:
 case CLOSING:
   if((event == PKT_RCV)&&((tcp->flags)&ACK)) //Receiving FIN's ACK+1
         if(htonl(tcp->ack) == tcb->seq_offs + tcb->sequence + 1){
-                                        tcb->fsm_timer = tick + tcb->timeout *4;
+                                        tw_arm(TW(s,TW_FSM), tick + tcb->timeout *4);
           tcb->st = TIME_WAIT;
-                                        while(tcb->txfirst!=NULL){
-                                                struct txcontrolbuf * tmp = tcb->txfirst;
-                                                tcb->txfirst = tcb->txfirst->next;
-                                                free(tmp);
-                                          }
+                                        tcb->txq_head = tcb->txq_tail;
                                 }
 
   break;
@@ -838,23 +2333,35 @@ case CLOSING:
 
 case TIME_WAIT:
                 if(event == TIMEOUT){
-                                                        while(tcb->unack!=NULL){
-                                        struct rxcontrol * tmp = tcb->unack;
-                                        tcb->unack = tcb->unack->next;
-                                        free(tmp);
-                                }
+                                if(fdinfo[s].users){ //an application thread still looks at it
+                                        tw_arm(TW(s,TW_FSM), tick + 1);
+                                        break;
+                                        }
                                 free(tcb->rxbuffer);
+                                if(!tcb->txlent) free(tcb->txbuffer);
+                                free(tcb->txq);
+                                stack_cnt[SHARD_ID].rxbuf_bytes -= tcb->rxbufsize;
+                                if(!tcb->txlent) stack_cnt[SHARD_ID].txbuf_bytes -= tcb->txbufsize;
+                                stack_cnt[SHARD_ID].txq_slots -= tcb->txq_size;
+                                for(i=0;i<TW_KINDS;i++) tw_cancel(TW(s,i));
+#ifdef CONGCTRL
+                                pace_cancel(s);
+#endif
+                                hash_remove(connhash, conn_hashfn(tcb->r_addr,tcb->r_port,fdinfo[s].l_port,fdinfo[s].l_addr), s);
                                 free(fdinfo[s].tcb);
-                                bzero(fdinfo+s,sizeof(struct socket_info));
-
-                                fdinfo[s].st=FREE;
+                                __atomic_fetch_sub(&port_refs[fdinfo[s].l_port], 1, __ATOMIC_RELEASE);
+                                fd_free(s); //and out of every myepoll instance with its epmask
+                                TRACE_EV(TR_FSM, s, old, TCP_CLOSED, event, 0);
+                                return 0;
                         }
 break;
 
 
 
         }
-printf("%.7ld: FSM: Socket: %d Next:State =%d, Input=%d \n",rtclock(0),s,tcb->st,event);
+if(tcb->st != old) TRACE_EV(TR_FSM, s, old, tcb->st, event, 0);
+sock_wake(s);
+LOG_TRACE("%.7ld: FSM: Socket: %d Next:State =%d, Input=%d \n",rtclock(0),s,tcb->st,event);
 }
 
 int myconnect(int s, struct sockaddr * addr, int addrlen){
@@ -868,6 +2375,11 @@ if((addr->sa_family == AF_INET)){
                                         local.sin_family = AF_INET;
                                         if(-1 == mybind(s,(struct sockaddr *) &local, sizeof(struct sockaddr_in)))     {myperror("implicit binding failed\n"); return -1; }
                         }
+#ifdef SHARDS
+                        fdinfo[s].shard = shard_of(a->sin_addr.s_addr, a->sin_port, fdinfo[s].l_addr, fdinfo[s].l_port);
+#endif
+                        SHARD_ENTER(s);
+                        STACK_LOCK();
                         if(fdinfo[s].st == TCP_BOUND){
                                         fdinfo[s].tcb = (struct tcpctrlblk *) malloc(sizeof(struct tcpctrlblk));
                                         bzero(fdinfo[s].tcb, sizeof(struct tcpctrlblk));
@@ -875,13 +2387,24 @@ if((addr->sa_family == AF_INET)){
                                         fdinfo[s].tcb->st = TCP_CLOSED;
                                         fdinfo[s].tcb->r_port = a->sin_port;
                                         fdinfo[s].tcb->r_addr = a->sin_addr.s_addr;
-                                        printf("%.7ld: Reset clock\n",rtclock(1));
+                                        hash_insert(connhash, conn_hashfn(a->sin_addr.s_addr,a->sin_port,fdinfo[s].l_port,fdinfo[s].l_addr), s);
+                                        rtclock(1); LOG_TRACE("%.7ld: Reset clock\n",rtclock(0));
                                         fsm(s,APP_ACTIVE_OPEN,NULL);
-                        } else {myerrno = EBADF; return -1; }
-                        while(sleep(10)){
-                                        if(fdinfo[s].tcb->st == ESTABLISHED ) return 0;
-                                        if(fdinfo[s].tcb->st == TCP_CLOSED ){ myerrno = ECONNREFUSED; return -1;}
+                        } else {
+                                        myerrno = (fdinfo[s].st != TCB_CREATED) ? EBADF : (fdinfo[s].tcb->st == SYN_SENT) ? EALREADY : EISCONN;
+                                        STACK_UNLOCK();
+                                        return -1;
+                        }
+                        if(fdinfo[s].nonblock){ STACK_UNLOCK(); myerrno = EINPROGRESS; return -1;} //POLLOUT, then SO_ERROR, tell the outcome
+                        long long start = tick;
+                        fdinfo[s].users++;
+                        while(STACK_WAIT()){
+                                        if(fdinfo[s].tcb->st == ESTABLISHED ) {fdinfo[s].users--; STACK_UNLOCK(); return 0;}
+                                        if(fdinfo[s].tcb->st == TCP_CLOSED ){ fdinfo[s].users--; STACK_UNLOCK(); myerrno = ECONNREFUSED; return -1;}
+                                        if((tick-start)*TIMER_USECS > 10*1000000) break;
                         }
+                        fdinfo[s].users--;
+                        STACK_UNLOCK();
                         myerrno=ETIMEDOUT; return -1;
 }
 else { myerrno = EBADF; return -1; }
@@ -889,258 +2412,613 @@ else { myerrno = EBADF; return -1; }
 else { myerrno = EINVAL; return -1; }
 }
 
-int mywrite(int s, unsigned char * buffer, int maxlen){
-int len,totlen=0,j,actual_len;
-if(fdinfo[s].st != TCB_CREATED || fdinfo[s].tcb->st != ESTABLISHED ){ myerrno = EINVAL; return -1; }
+int mywritev(int s, struct iovec * iov, int iovcnt){
+int i,len,totlen=0,actual_len,maxlen=0;
+if(s < 3 || s >= MAX_FD || iovcnt < 0){ myerrno = EINVAL; return -1; }
+for(i=0;i<iovcnt;i++) maxlen += iov[i].iov_len;
 if(maxlen == 0) return 0;
 
+SHARD_ENTER(s);
+if(-1 == STACK_LOCK()){perror("stack lock"); return -1 ;}
+if(fdinfo[s].st != TCB_CREATED || fdinfo[s].tcb->st != ESTABLISHED ){ STACK_UNLOCK(); myerrno = EINVAL; return -1; }
+fdinfo[s].users++;
 do{
 actual_len = MIN(maxlen,fdinfo[s].tcb->txfree);
 if ((actual_len !=0) || (fdinfo[s].tcb->st == TCP_CLOSED)) break;
-}while(pause());
+if(fdinfo[s].nonblock){ fdinfo[s].users--; STACK_UNLOCK(); myerrno = EAGAIN; return -1;}
+}while(STACK_WAIT());
 
-for(j=0;j<actual_len; j+=fdinfo[s].tcb->mss){
-                len = MIN(fdinfo[s].tcb->mss, actual_len-j);
-if(-1 == sigprocmask(SIG_BLOCK, &mymask, NULL)){perror("sigprocmask"); return -1 ;}
-                prepare_tcp(s,ACK,buffer+j,len,NULL,0);
-if(-1 == sigprocmask(SIG_UNBLOCK, &mymask, NULL)){perror("sigprocmask"); return -1 ;}
-                fdinfo[s].tcb->txfree -= len;
-                totlen += len;
+for(i=0; totlen < actual_len; i++){
+        len = MIN(iov[i].iov_len, actual_len - totlen);
+        prepare_tcp(s,ACK,iov[i].iov_base,len,NULL,0);
+        totlen += len;
         }
+fdinfo[s].tcb->txfree -= actual_len;
+fdinfo[s].users--;
+STACK_UNLOCK();
 return totlen;
 }
 
+int mywrite(int s, unsigned char * buffer, int maxlen){
+struct iovec iov = { .iov_base = buffer, .iov_len = maxlen };
+return mywritev(s, &iov, 1);
+}
+
+/* Registered buffer mode: the application lends buf as the send ring of s.
+ * Data is produced in place at mywbuf() and handed over with mywrite() on
+ * that same pointer: segments reference it until ACKed, nothing is copied.
+ * Allowed only while nothing is queued on the connection. */
+int myregbuf(int s, unsigned char * buf, int size){
+struct tcpctrlblk * t;
+if(s < 3 || s >= MAX_FD || buf == NULL || size < TCP_MSS){ myerrno = EINVAL; return -1; }
+SHARD_ENTER(s);
+STACK_LOCK();
+if(fdinfo[s].st != TCB_CREATED || fdinfo[s].tcb->st != ESTABLISHED ){ STACK_UNLOCK(); myerrno = EINVAL; return -1; }
+t = fdinfo[s].tcb;
+if(!TX_IDLE(t) || t->txfree != t->txbufsize){ STACK_UNLOCK(); myerrno = EBUSY; return -1; }
+if(!t->txlent){
+        free(t->txbuffer);
+        stack_cnt[SHARD_ID].txbuf_bytes -= t->txbufsize;
+        }
+t->txbuffer = buf;
+t->txbufsize = t->txfree = size;
+t->txhead = 0;
+t->txlent = 1;
+if(t->txq_size < 2*(size/TCP_MSS) + 64){
+        stack_cnt[SHARD_ID].txq_slots -= t->txq_size;
+        for(t->txq_size = 64; t->txq_size < 2*(size/TCP_MSS) + 64; t->txq_size <<= 1);
+        stack_cnt[SHARD_ID].txq_slots += t->txq_size;
+        free(t->txq);
+        t->txq = (struct txcontrolbuf *) malloc(t->txq_size * sizeof(struct txcontrolbuf));
+        t->txq_head = t->txq_tail = 0;
+        }
+STACK_UNLOCK();
+return 0;
+}
 
-int myread(int s, unsigned char *buffer, int maxlen)
+/* Where the next written byte goes in the send ring; *len is set to the free
+ * room that is contiguous from there. The pointer stays valid until the
+ * application hands the bytes over with mywrite(), calls myregbuf() or
+ * myclose() on s: the stack frees or replaces the ring only then. */
+unsigned char * mywbuf(int s, int * len){
+struct tcpctrlblk * t;
+unsigned char * p;
+if(s < 3 || s >= MAX_FD){ myerrno = EINVAL; return NULL; }
+SHARD_ENTER(s);
+STACK_LOCK();
+if(fdinfo[s].st != TCB_CREATED || fdinfo[s].tcb->st != ESTABLISHED ){ STACK_UNLOCK(); myerrno = EINVAL; return NULL; }
+t = fdinfo[s].tcb;
+*len = MIN(t->txfree, t->txbufsize - t->txhead);
+p = t->txbuffer + t->txhead;
+STACK_UNLOCK();
+return p;
+}
+
+int myreadv(int s, struct iovec * iov, int iovcnt)
 {
-int j,actual_len;
-if((fdinfo[s].st != TCB_CREATED) || (fdinfo[s].tcb->st < ESTABLISHED )){ myerrno = EINVAL; return -1; }
+int i,j,len,first,actual_len,maxlen=0;
+unsigned int offs;
+struct tcpctrlblk * t;
+if(s < 3 || s >= MAX_FD || iovcnt < 0){ myerrno = EINVAL; return -1; }
+for(i=0;i<iovcnt;i++) maxlen += iov[i].iov_len;
 if (maxlen==0) return 0;
-actual_len = MIN(maxlen,fdinfo[s].tcb->cumulativeack - fdinfo[s].tcb->rx_win_start);
-if(fdinfo[s].tcb->cumulativeack > fdinfo[s].tcb->stream_end) actual_len --;
-if(actual_len==0){
-                while(pause()){
-                        actual_len = MIN(maxlen,fdinfo[s].tcb->cumulativeack - fdinfo[s].tcb->rx_win_start);
-                        if(actual_len>0 && (fdinfo[s].tcb->cumulativeack > fdinfo[s].tcb->stream_end)) actual_len --;
-                        if(actual_len!=0) break;
-                        if(fdinfo[s].tcb->rx_win_start)
-                                if(fdinfo[s].tcb->rx_win_start==fdinfo[s].tcb->stream_end) {return 0;}
-        if ((fdinfo[s].tcb->st == CLOSE_WAIT) && (fdinfo[s].tcb->unack == NULL ) ) {return 0;} // FIN received and acknowledged
-                }
+SHARD_ENTER(s);
+STACK_LOCK();
+if((fdinfo[s].st != TCB_CREATED) || (fdinfo[s].tcb->st < ESTABLISHED )){ STACK_UNLOCK(); myerrno = EINVAL; return -1; }
+t = fdinfo[s].tcb;
+fdinfo[s].users++;
+while((actual_len = MIN(maxlen,rx_avail(t))) == 0){
+        if(rx_eof(t)) {fdinfo[s].users--; STACK_UNLOCK(); return 0;} // FIN received and acknowledged
+        if(t->st == TCP_CLOSED) {fdinfo[s].users--; STACK_UNLOCK(); myerrno = ETIMEDOUT; return -1;} // dropped by keepalive
+        if(fdinfo[s].nonblock) {fdinfo[s].users--; STACK_UNLOCK(); myerrno = EAGAIN; return -1;}
+        (void) STACK_WAIT();
         }
-for(j=0; j<actual_len; j++){
-        buffer[j]=fdinfo[s].tcb->rxbuffer[(fdinfo[s].tcb->rx_win_start + j)%RXBUFSIZE];
-}
-fdinfo[s].tcb->rx_win_start+=j;
+for(i=0, j=0; j<actual_len; i++, j+=len){ // at most two memcpy per iovec: before and after the wrap
+        len = MIN(iov[i].iov_len, actual_len - j);
+        offs = (t->rx_win_start + j) % t->rxbufsize;
+        first = MIN(len, t->rxbufsize - offs);
+        memcpy(iov[i].iov_base, t->rxbuffer + offs, first);
+        memcpy((unsigned char *)iov[i].iov_base + first, t->rxbuffer, len - first);
+        }
+t->rx_win_start+=j;
+t->adwin = t->rxbufsize - (t->cumulativeack - t->rx_win_start);
+if(WIN_UPDATE(t)) tx_kick(s); //a peer stopped by our window waits for this
+fdinfo[s].users--;
+STACK_UNLOCK();
 return j;
 }
 
+int myread(int s, unsigned char *buffer, int maxlen)
+{
+struct iovec iov = { .iov_base = buffer, .iov_len = maxlen };
+return myreadv(s, &iov, 1);
+}
+
 int myclose(int s){
-if((fdinfo[s].st == TCP_CLOSED) || (fdinfo[s].st == TCP_UNBOUND)) { myerrno = EBADF; return -1;}
+if(s < 3 || s >= MAX_FD) { myerrno = EBADF; return -1;}
+SHARD_ENTER(s);
+STACK_LOCK();
+if(fdinfo[s].st != TCB_CREATED) { STACK_UNLOCK(); myerrno = EBADF; return -1;} //free, never connected, or torn down meanwhile
 fsm(s,APP_CLOSE,NULL);
+STACK_UNLOCK();
 return 0;
 }
 
-void mytimer(int number){
-int i,tot,isfasttransmit, karn_invalidate=0;
-struct txcontrolbuf * txcb;
-if(-1 == sigprocmask(SIG_BLOCK, &mymask, NULL)){perror("sigprocmask"); return ;}
-fl++;
-tick++;
+#ifdef CONGCTRL
+/* Pacing: a data segment of totlen bytes pushes pace_next forward by
+ * totlen/pace_rate. A socket that has to wait goes in pace_heap, a min-heap
+ * on pace_next, and the pacing timer (a timerfd or a POSIX timer, ns
+ * resolution) is kept armed on its top, independently of the tick. */
+#define PACE_KEY(k) (fdinfo[pace_heap[k]].tcb->pace_next)
+
+void pace_swap(int a, int b){
+int t = pace_heap[a];
+pace_heap[a] = pace_heap[b];
+pace_heap[b] = t;
+pace_pos[pace_heap[a]] = a+1;
+pace_pos[pace_heap[b]] = b+1;
+}
 
-//if(tick%(50000/TIMER_USECS)){ printf("%.7ld: tick=%lld\n",rtclock(0),tick);}
-//if(tick%(1000000/TIMER_USECS)){ //;//printf("Mytimer Called\n"); }
-if (fl > 1) printf("Overlap Timer\n");
-for(i=0;i<MAX_FD;i++){
-        if(fdinfo[i].st == TCB_CREATED){
-                struct tcpctrlblk * tcb = fdinfo[i].tcb;
-                if((tcb->fsm_timer!=0 ) && (tcb->fsm_timer < tick)){
-                        fsm(i,TIMEOUT,NULL);
-                        continue;
-                        }
+void pace_sift(int k){
+int c;
+for(; k > 0 && PACE_KEY(k) < PACE_KEY((k-1)/2); k = (k-1)/2)
+        pace_swap(k, (k-1)/2);
+for(; (c = 2*k+1) < pace_n; k = c){
+        if(c+1 < pace_n && PACE_KEY(c+1) < PACE_KEY(c)) c++;
+        if(PACE_KEY(k) <= PACE_KEY(c)) break;
+        pace_swap(k, c);
+        }
+}
 
+void pace_arm(){
+long long when = (pace_n) ? PACE_KEY(0) : 0;
+if(when == pace_armed) return;
+pace_armed = when;
+#ifdef EVLOOP
+struct itimerspec ts = { .it_value = { when/1000000000LL, when%1000000000LL } };
+if(-1 == timerfd_settime(pfd, TFD_TIMER_ABSTIME, &ts, NULL)) perror("pacing timerfd_settime");
+#else
+struct itimerspec ts = { .it_value = { when/1000000000LL, when%1000000000LL } };
+if(-1 == timer_settime(pacetimer, TIMER_ABSTIME, &ts, NULL)) perror("pacing timer_settime");
+#endif
+}
+
+void pace_schedule(int s){
+if(pace_pos[s] == 0){
+        pace_heap[pace_n] = s;
+        pace_pos[s] = ++pace_n;
+        }
+pace_sift(pace_pos[s]-1);
+pace_arm();
+}
+
+void pace_remove(int s){
+int k = pace_pos[s]-1;
+if(k < 0) return;
+pace_pos[s] = 0;
+if(k != --pace_n){
+        pace_heap[k] = pace_heap[pace_n];
+        pace_pos[pace_heap[k]] = k+1;
+        pace_sift(k);
+        }
+}
+
+void pace_cancel(int s){
+pace_remove(s);
+pace_arm();
+}
+
+/* 1 if a data segment of len bytes may leave now, else s is queued for later */
+int pace_ok(int s, int len){
+struct tcpctrlblk * t = fdinfo[s].tcb;
+long long now;
+if((t->pace_rate = t->cc->pacing_rate(t)) == 0) return 1;
+now = monotonic_ns();
+if(now < t->pace_next){
+        pace_schedule(s);
+        return 0;
+        }
+if(pace_pos[s]) pace_cancel(s); //its time came before the pacing timer did
+t->pace_next = MAX(t->pace_next, now) + len*1000000000LL/t->pace_rate;
+return 1;
+}
+#endif
+
+/* Sends what is due on socket i: first transmissions the windows allow and
+ * segments whose RTO expired. Re-arms the RTO timer on the earliest pending
+ * retransmission, the persist timer when only the peer window stops us. */
+void tx_pass(int i){
+int tot,isfasttransmit, karn_invalidate=0, seglen, probe;
+unsigned int k;
+long long next = LLONG_MAX; //no retransmission pending
+struct txcontrolbuf * txcb;
+struct tcp_segment segment;
+struct tcpctrlblk * tcb = fdinfo[i].tcb;
+probe = tcb->persist_probe;
+tcb->persist_probe = 0;
 #ifdef CONGCTRL
-                //for(tot=0,txcb=tcb->txfirst;  txcb!=NULL && (tot<MIN(tcb->cgwin+tcb->lta,tcb->radwin)); tot+=txcb->totlen, txcb = txcb->next){
-                for(tot=0,txcb=tcb->txfirst;  txcb!=NULL && (tot<(tcb->cgwin+tcb->lta)); tot+=txcb->totlen, txcb = txcb->next){
-                        if(txcb->retry==0) //first transmission
-                                fdinfo[i].tcb->flightsize+=txcb->payloadlen;
-                        else
+//for(tot=0,k=tcb->txq_head; (tot<MIN(tcb->cgwin+tcb->lta,tcb->radwin)); tot+=txcb->totlen, k++){
+for(tot=0,k=tcb->txq_head; (tot<(tcb->cgwin+tcb->lta)); tot+=(txcb->sacked)?0:txcb->totlen, k++){
+        if((k == tcb->txq_tail) && (tx_hold(i) || tx_cut_data(tcb) == NULL)) break; //segments are cut only when the window allows
+        txcb = TXQ_AT(tcb,k);
+        if(txcb->sacked) continue; //already at the receiver
 #else
-                for(tot=0,txcb=tcb->txfirst;  txcb!=NULL  /*&& (tot<tcb->radwin)*/;  txcb = txcb->next){
-#endif
-                        if (karn_invalidate) txcb->retry++; //a previous segment has been retransmitted, so this one cannot be used for RTO
-                  if(txcb->txtime+tcb->timeout > tick )  continue; //No timeout
-                        isfasttransmit = (txcb->txtime == 0); //FAST TRANSMIT for duplicate acks
-                        txcb->txtime=tick;
-                        if(!karn_invalidate) txcb->retry ++; //increment only if not already incremented by invalidation
-                        karn_invalidate = (txcb->retry > 1 ); // if it is a retransmission the next segments cannot be used for RTO
-                        update_tcp_header(i, txcb);
-                        send_ip((unsigned char*) txcb->segment, (unsigned char*) &fdinfo[i].tcb->r_addr, txcb->totlen, TCP_PROTO);
-                        printf("%.7ld: TX SOCK: %d SEQ:%d:%d ACK:%d Timeout = %lld FLAGS:0x%.2X (%d times)\n",rtclock(0),i,htonl(txcb->segment->seq) - fdinfo[i].tcb->seq_offs,htonl(txcb->segment->seq) - fdinfo[i].tcb->seq_offs+txcb->payloadlen,htonl(txcb->segment->ack) - fdinfo[i].tcb->ack_offs,tcb->timeout*TIMER_USECS/1000,txcb->segment->flags,txcb->retry);
+for(tot=0,k=tcb->txq_head; /*(tot<tcb->radwin)*/; k++){
+        if((k == tcb->txq_tail) && (tx_hold(i) || tx_cut_data(tcb) == NULL)) break;
+        txcb = TXQ_AT(tcb,k);
+        if(txcb->sacked) continue; //already at the receiver
+#endif
+        if(txcb->retry==0 && txcb->payloadlen && (txcb->seq + txcb->payloadlen - TXQ_AT(tcb,tcb->txq_head)->seq > tcb->radwin)){
+                if(!probe){ //peer window full
+                        if(k == tcb->txq_head && !TW_ARMED(i,TW_PERSIST)) //nothing in flight will bring an update
+                                tw_arm(TW(i,TW_PERSIST), tick + (MIN(tcb->timeout << tcb->persist_shift++, MAXRTO)));
+                        break;
+                        }
+                probe = 0;
+                }
+        else if(txcb->retry==0 && txcb->payloadlen) tcb->persist_shift = 0;
+#ifdef CONGCTRL
+        if(txcb->retry==0) //first transmission
+                fdinfo[i].tcb->flightsize+=txcb->payloadlen;
+        else
+#endif
+        if (karn_invalidate) txcb->retry++; //a previous segment has been retransmitted, so this one cannot be used for RTO
+  if(txcb->txtime+tcb->timeout > tick ){ next = MIN(next, txcb->txtime+tcb->timeout); continue;} //No timeout
+#ifdef CONGCTRL
+        if(txcb->payloadlen && !pace_ok(i, txcb->totlen)) break; //the pacing timer resumes from here
+#endif
+        isfasttransmit = (txcb->txtime == 0); //FAST TRANSMIT for duplicate acks
+        txcb->txtime=tick;
+        next = MIN(next, tick+tcb->timeout);
+        if(!karn_invalidate) txcb->retry ++; //increment only if not already incremented by invalidation
+        karn_invalidate = (txcb->retry > 1 ); // if it is a retransmission the next segments cannot be used for RTO
+        seglen = build_tcp(i, txcb, &segment);
+        send_ip((unsigned char*) &segment, (unsigned char*) &fdinfo[i].tcb->r_addr, seglen, TCP_PROTO);
+        TCB_STAT(tcb, segs_out);
+        TRACE_EV(TR_TX, i, txcb->seq - tcb->seq_offs, ntohl(segment.ack) - tcb->ack_offs, txcb->payloadlen, txcb->flags | txcb->retry << 8);
+        if(txcb->retry > 1){
+                TCB_STAT(tcb, retrans);
+                if(isfasttransmit) TCB_STAT(tcb, fast_retrans);
+                else {
+                        TCB_STAT(tcb, rtos);
+                        TRACE_EV(TR_RTO, i, txcb->seq - tcb->seq_offs, tcb->timeout*TIMER_USECS, txcb->retry, 0);
+                        }
+                }
+        if((int)(txcb->seq + txcb->payloadlen + ((txcb->flags&(SYN|FIN)) ? 1 : 0) - tcb->snd_max) > 0)
+                tcb->snd_max = txcb->seq + txcb->payloadlen + ((txcb->flags&(SYN|FIN)) ? 1 : 0);
+        LOG_TRACE("%.7ld: TX SOCK: %d SEQ:%d:%d ACK:%d Timeout = %lld FLAGS:0x%.2X (%d times)\n",rtclock(0),i,txcb->seq - fdinfo[i].tcb->seq_offs,txcb->seq - fdinfo[i].tcb->seq_offs+txcb->payloadlen,htonl(segment.ack) - fdinfo[i].tcb->ack_offs,tcb->timeout*TIMER_USECS/1000,txcb->flags,txcb->retry);
 #ifdef CONGCTRL
-                        if((txcb->retry > 1) &&(tcb->st >= ESTABLISHED) && !isfasttransmit)
-                                congctrl_fsm(tcb,TIMEOUT,NULL,0);
-                        printf(" Thresh: %d TxWin/MSS: %f, ST: %d RTT_E:%d\n",tcb->ssthreshold, tcb->cgwin/(float)tcb->mss,tcb->cong_st,tcb->rtt_e);
+        if((txcb->retry > 1) &&(tcb->st >= ESTABLISHED) && !isfasttransmit)
+                congctrl_fsm(i,tcb,TIMEOUT,NULL,0);
+        LOG_TRACE(" Thresh: %d TxWin/MSS: %f, ST: %d RTT_E:%d\n",tcb->ssthreshold, tcb->cgwin/(float)tcb->mss,tcb->cong_st,tcb->rtt_e);
 #endif
+        }
+if(next != LLONG_MAX) tw_arm(TW(i,TW_RTO), next);
+else tw_cancel(TW(i,TW_RTO));
+if(tcb->st >= ESTABLISHED && WIN_UPDATE(tcb)) send_ack(i, tcb->snd_max); //no segment above carried the window update
+}
+
+/* Idle connection: probe with the last byte the peer already acknowledged */
+void keepalive_probe(int i){
+struct tcpctrlblk * tcb = fdinfo[i].tcb;
+if(tcb->ka_probes++ == KEEPALIVE_PROBES){
+        LOG_INFO("%.7ld: SOCK %d: no answer to keepalive, connection dropped\n",rtclock(0),i);
+        tcb->st = TCP_CLOSED;
+        tcb->txq_head = tcb->txq_tail;
+        sock_wake(i);
+        return;
+        }
+send_ack(i, tcb->snd_max - 1);
+tw_arm(TW(i,TW_KEEPALIVE), tick + KEEPALIVE_INTVL);
+}
+
+/* Runs the wheel slots from wheel_now up to tick */
+void tw_advance(){
+struct tw_timer * head, * t;
+int l, s, kind;
+long long now;
+while(wheel_now < tick){
+        now = wheel_now + 1;
+        for(l = TW_LEVELS-1; l > 0; l--) //cascade from the top, so that timers can move down more than one level
+                if((now & ((1LL << (l*TW_BITS)) - 1)) == 0)
+                        for(tw_detach(&wheel[l][(now >> (l*TW_BITS)) & (TW_SLOTS-1)], &head); (t = head) != NULL; )
+                                tw_arm(t, t->expire);
+        wheel_now = now; //from here on callbacks arm for the next slots
+        for(tw_detach(&wheel[0][now & (TW_SLOTS-1)], &head); (t = head) != NULL; ){
+                tw_cancel(t);
+                s = (t - &tw_timers[0][0]) / TW_KINDS;
+                kind = (t - &tw_timers[0][0]) % TW_KINDS;
+                if(fdinfo[s].st != TCB_CREATED) continue;
+                switch(kind){
+                        case TW_FSM: fsm(s,TIMEOUT,NULL); break;
+                        case TW_KEEPALIVE: if(fdinfo[s].keepalive && fdinfo[s].tcb->st == ESTABLISHED) keepalive_probe(s); break;
+                        case TW_DELACK: if(fdinfo[s].tcb->ack_pending) send_ack(s, fdinfo[s].tcb->snd_max); break;
+                        case TW_PERSIST: fdinfo[s].tcb->persist_probe = 1; tx_kick(s); break;
+                        default: tx_kick(s); //RTO
                         }
+                }
         }
 }
+
+void mytimer(int number){
+int i,k;
+if(-1 == STACK_LOCK()){perror("stack lock"); return ;}
+fl++;
+tick++;
+
+//if(tick%(50000/TIMER_USECS)){ printf("%.7ld: tick=%lld\n",rtclock(0),tick);}
+//if(tick%(1000000/TIMER_USECS)){ //;//printf("Mytimer Called\n"); }
+if (fl > 1) LOG_TRACE("Overlap Timer\n");
+tw_advance();
+arp_timer();
+if(phy->timer) phy->timer();
+if(STATS_SECS && LOG_LEVEL >= 1 && SHARD_ID == 0 && tick >= stats_next){
+        if(stats_next) stats_dump();
+        stats_next = tick + STATS_SECS*1000000LL/TIMER_USECS;
+        }
+for(k=0;k<txready_n;k++){
+        i = txready[k];
+        txready_on[i] = 0;
+        if(fdinfo[i].st == TCB_CREATED && SHARD_MINE(i))
+                tx_pass(i);
+        }
+txready_n = 0;
+        tx_flush();
         fl--;
-        if(-1 == sigprocmask(SIG_UNBLOCK, &mymask, NULL)){perror("sigprocmask"); return ;}
+        if(-1 == STACK_UNLOCK()){perror("stack unlock"); return ;}
 }
 
-void printrxq(struct rxcontrol* n){
-printf(" RXQ: ");
-for( ; n!=NULL; n = n->next)
-        printf("(%d %d) ",n->stream_offs, n->streamsegmentsize);
-printf("\n");
+#ifdef CONGCTRL
+/* Pacing timer expired: sends for every socket whose pace_next has come */
+void mypace(int number){
+int s;
+long long now;
+if(-1 == STACK_LOCK()){perror("stack lock"); return ;}
+fl++;
+now = monotonic_ns();
+pace_armed = 0; //one shot, it has fired
+while(pace_n && PACE_KEY(0) <= now){
+        s = pace_heap[0];
+        pace_remove(s);
+        if(fdinfo[s].st == TCB_CREATED)
+                tx_pass(s);
+        }
+pace_arm();
+tx_flush();
+fl--;
+if(-1 == STACK_UNLOCK()){perror("stack unlock"); return ;}
 }
+#endif
 
+void printrxq(struct tcpctrlblk * tcb){
+LOG_TRACE(" RXQ: ");
+for(int k=0; k<tcb->rxq_n; k++)
+        LOG_TRACE("(%d %d) ",tcb->rxq[k].start, tcb->rxq[k].end - tcb->rxq[k].start);
+LOG_TRACE("\n");
+}
 
-void myio(int number)
-{
-int i,len,size,shifter;
-//;//printf("Myio Called\n");
-struct ethernet_frame * eth=(struct ethernet_frame *)l2buffer;
+/* Adds [start,end) to the received ranges merging every range it overlaps
+ * or touches. Returns -1 if it would need a new range and none is left. */
+int rx_insert(struct tcpctrlblk * tcb, unsigned int start, unsigned int end){
+int lo = 0, hi = tcb->rxq_n, mid, j;
+while(lo < hi){ // first range that ends at or after start
+        mid = (lo + hi)/2;
+        if(tcb->rxq[mid].end < start) lo = mid + 1;
+        else hi = mid;
+        }
+for(j = lo; j < tcb->rxq_n && tcb->rxq[j].start <= end; j++){
+        start = MIN(start, tcb->rxq[j].start);
+        end = MAX(end, tcb->rxq[j].end);
+        }
+if(j == lo){
+        if(tcb->rxq_n == RX_MAX_RANGES) return -1;
+        memmove(tcb->rxq + lo + 1, tcb->rxq + lo, (tcb->rxq_n - lo)*sizeof(struct rxrange));
+        tcb->rxq_n++;
+        }
+else if(j > lo + 1){
+        memmove(tcb->rxq + lo + 1, tcb->rxq + j, (tcb->rxq_n - j)*sizeof(struct rxrange));
+        tcb->rxq_n -= j - lo - 1;
+        }
+tcb->rxq[lo].start = start;
+tcb->rxq[lo].end = end;
+return 0;
+}
 
-if(-1 == sigprocmask(SIG_BLOCK, &mymask, NULL)){perror("sigprocmask"); return ;}
-fl++;
-if (fl > 1) ;//printf("Overlap (%d) in myio\n",fl);
-if( poll(fds,1,0) == -1) { perror("Poll failed"); return; }
-if (fds[0].revents & POLLIN){
-        len = sizeof(struct sockaddr_ll);
-        while ( 0 <= (size = recvfrom(unique_s,eth,MAXFRAME,0, (struct sockaddr *) &sll,&len))){
-                if(size >1000) ;//printf("Packet %d-bytes received\n",size);
-                if (eth->type == htons (0x0806)) {
-                        struct arp_packet * arp = (struct arp_packet *) eth->payload;
-                        if(htons(arp->op) == 2){ //It is ARP response
-                                for(i=0;(i<MAX_ARP) && (arpcache[i].key!=0);i++)
-                                if(!memcmp(&arpcache[i].key,arp->srcip,4)){
-                                        memcpy(arpcache[i].mac,arp->srcmac,6); // Update
-                                        break;
+
+/* Handles one received L2 frame. The frame may live in the RX ring and is only
+ * valid until the caller hands its block back to the kernel. */
+void process_frame(unsigned char * frame, int size)
+{
+int i;
+unsigned int shifter;
+struct ethernet_frame * eth=(struct ethernet_frame *)frame;
+if(size >1000) ;//printf("Packet %d-bytes received\n",size);
+if (eth->type == htons (0x0806)) {
+        struct arp_packet * arp = (struct arp_packet *) eth->payload;
+        if(htons(arp->op) == 2){ //It is ARP response
+                arp_insert(*(unsigned int *)arp->srcip, arp->srcmac);
+                arp_resolved(*(unsigned int *)arp->srcip, arp->srcmac);
+                }
+        else if(htons(arp->op) == 1 && !memcmp(arp->dstip, myip, 4)){ //who has myip: the asker is learnt too (RFC 826)
+                arp_insert(*(unsigned int *)arp->srcip, arp->srcmac);
+                arp_resolved(*(unsigned int *)arp->srcip, arp->srcmac);
+                arp_send(2, arp->srcmac, *(unsigned int *)arp->srcip);
+                }
+} //it is ARP
+else if(eth->type == htons(0x0800)){
+        struct ip_datagram * ip = (struct ip_datagram *) eth->payload;
+        if (ip->proto == TCP_PROTO){
+                struct tcp_segment * tcp = (struct tcp_segment *) ((char*)ip + (ip->ver_ihl&0x0F)*4);
+                TABLES_RDLOCK();
+                i = conn_lookup(ip->srcaddr, tcp->s_port, tcp->d_port, ip->dstaddr);
+                if(i==0)// if  not found connected TCB : second choice: listening socket
+                        i = listen_lookup(tcp->d_port, ip->srcaddr, tcp->s_port);
+#ifdef SHARDS
+                if(i!=0 && !SHARD_MINE(i)){ //a listener of another shard
+                        int k = fdinfo[i].shard;
+                        TABLES_UNLOCK();
+                        if(handoff_frame(k, frame, size) == -1){ LOG_INFO("Handoff to shard %d failed: frame dropped\n", k); STAT(handoff_drops);}
+                        return;
+                        }
+#endif
+                TABLES_UNLOCK();
+          if(i!=0)
+                                {
+                                struct tcpctrlblk * tcb = fdinfo[i].tcb;
+                                //printbuf((unsigned char*)ip,htons(ip->totlen));
+                                ;//printf("(remote:%d) ---> (locahost:%d) socket=%d\n",htons(tcp->s_port),htons(tcp->d_port),i);
+
+                                ;//printf("Received ack %d\n", htonl(tcp->ack)-tcb->seq_offs);
+                                LOG_TRACE("%.7ld: RX SOCK:%d ACK %d SEQ:%d SIZE:%d FLAGS:0x%.2X\n",rtclock(0),i,htonl(tcp->ack)-tcb->seq_offs,htonl(tcp->seq)-tcb->ack_offs,  htons(ip->totlen) - (ip->ver_ihl&0xF)*4 - (tcp->d_offs_res>>4)*4, tcp->flags);
+                                if(!(rand()%INV_LOSS_RATE) && g_argv[4][0]=='C') {LOG_TRACE("========== RX LOST ===============\n");return;}
+                                TCB_STAT(tcb, segs_in);
+                                TRACE_EV(TR_RX, i, ntohl(tcp->seq) - tcb->ack_offs, ntohl(tcp->ack) - tcb->seq_offs,
+                                        htons(ip->totlen) - (ip->ver_ihl&0xF)*4 - (tcp->d_offs_res>>4)*4, tcp->flags | htons(tcp->window) << 8);
+                                fsm(i,PKT_RCV,ip);
+                                tx_kick(i); //acks, window updates and duplicate acks may let segments go
+                                sock_wake(i); //new data or room: looked at once the stack lock is released
+                                if(fdinfo[i].keepalive){
+                                        tcb->ka_probes = 0;
+                                        tw_arm(TW(i,TW_KEEPALIVE), tick + KEEPALIVE_IDLE);
                                         }
-                                        if(arpcache[i].key==0){
-                                                ;//printf("New ARP cache entry inserted\n");
-                                                memcpy(arpcache[i].mac,arp->srcmac,6); //new insert
-                                                memcpy(&arpcache[i].key,arp->srcip,4); // Update
+                                ;//printf("status = %d\n",fdinfo[i].tcb->st);
+                                if(tcb->st < ESTABLISHED)return;
+
+                                unsigned int streamsegmentsize = htons(ip->totlen) - (ip->ver_ihl&0xF)*4 - (tcp->d_offs_res>>4)*4;
+                                unsigned int stream_offs = ntohl(tcp->seq)-tcb->ack_offs;
+                                unsigned char * streamsegment = ((unsigned char*)tcp)+((tcp->d_offs_res>>4)*4);
+                                unsigned int rangeend;
+#ifdef CONGCTRL
+                                unsigned int tsecr = 0;
+                                int has_ts = 0; //TSecr 0 is a valid echo
+#endif
+                                unsigned char * ts;
+                                int tslen;
+
+                                if(tcb->ts_ok && (ts = tcp_option(tcp, TCPOPT_TIMESTAMP, &tslen)) != NULL && tslen == 10){
+#ifdef CONGCTRL
+                                        tsecr = ntohl(*(unsigned int *)(ts+6));
+                                        has_ts = 1;
+#endif
+                                        if(stream_offs <= tcb->cumulativeack && (int)(ntohl(*(unsigned int *)(ts+2)) - tcb->ts_recent) >= 0)
+                                                tcb->ts_recent = ntohl(*(unsigned int *)(ts+2)); //RFC 7323 4.3: not from a segment past a hole
                                         }
-                        }// It is ARP response
-                } //it is ARP
-                else if(eth->type == htons(0x0800)){
-                        struct ip_datagram * ip = (struct ip_datagram *) eth->payload;
-                        if (ip->proto == TCP_PROTO){
-                                struct tcp_segment * tcp = (struct tcp_segment *) ((char*)ip + (ip->ver_ihl&0x0F)*4);
-                                for(i=0;i<MAX_FD;i++)
-                                        if((fdinfo[i].st == TCB_CREATED) && (fdinfo[i].l_port == tcp->d_port)
-                                                        && (tcp->s_port == fdinfo[i].tcb->r_port) && (ip->srcaddr == fdinfo[i].tcb->r_addr))
-                                                                break;
-                                if(i==MAX_FD)// if  not found connected TCB : second choice: listening socket
-                        for(i=0;i<MAX_FD;i++) // Foreach TCB find listening sockets
-                                if((fdinfo[i].st == TCB_CREATED) &&(fdinfo[i].tcb->st==LISTEN) && (tcp->d_port == fdinfo[i].l_port))
-                        break;
-                          if(i<MAX_FD)
-                                                {
-                                                struct tcpctrlblk * tcb = fdinfo[i].tcb;
-                                                //printbuf((unsigned char*)ip,htons(ip->totlen));
-                                                ;//printf("(remote:%d) ---> (locahost:%d) socket=%d\n",htons(tcp->s_port),htons(tcp->d_port),i);
-
-                                                ;//printf("Received ack %d\n", htonl(tcp->ack)-tcb->seq_offs);
-                                                printf("%.7ld: RX SOCK:%d ACK %d SEQ:%d SIZE:%d FLAGS:0x%.2X\n",rtclock(0),i,htonl(tcp->ack)-tcb->seq_offs,htonl(tcp->seq)-tcb->ack_offs,  htons(ip->totlen) - (ip->ver_ihl&0xF)*4 - (tcp->d_offs_res>>4)*4, tcp->flags);
-                                                if(!(rand()%INV_LOSS_RATE) && g_argv[4][0]=='C') {printf("========== RX LOST ===============\n");break;}
-                                                fsm(i,PKT_RCV,ip);
-                                                ;//printf("status = %d\n",fdinfo[i].tcb->st);
-                                                if(tcb->st < ESTABLISHED)break;
-
-                                                unsigned int streamsegmentsize = htons(ip->totlen) - (ip->ver_ihl&0xF)*4 - (tcp->d_offs_res>>4)*4;
-                                                unsigned int stream_offs = ntohl(tcp->seq)-tcb->ack_offs;
-                                                unsigned char * streamsegment = ((unsigned char*)tcp)+((tcp->d_offs_res>>4)*4);
-                                                struct rxcontrol * curr, *newrx, *prev;
-
-                                                if(tcb->txfirst !=NULL){
-                                                        shifter = htonl(tcb->txfirst->segment->seq);
-                                                        ;//printf("Processing ack  %d\n", htonl(tcp->ack)-tcb->seq_offs);
-                                                        if((htonl(tcp->ack)-shifter >= 0) && (htonl(tcp->ack)-shifter-(tcb->stream_end)?1:0 <= htonl(tcb->txlast->segment->seq) + tcb->txlast->payloadlen - shifter)){ // -1 is to compensate the FIN
-                                                                 while((tcb->txfirst!=NULL) && ((htonl(tcp->ack)-shifter) >= (htonl(tcb->txfirst->segment->seq)-shifter + tcb->txfirst->payloadlen))){ //Ack>=Seq+payloadlen
-                                                                        struct txcontrolbuf * temp = tcb->txfirst;
-                                                                                tcb->txfirst = tcb->txfirst->next;
-                                                                                ;//printf("Removing seq %d\n",htonl(temp->segment->seq)-tcb->seq_offs);
-                                                                                fdinfo[i].tcb->txfree+=temp->payloadlen;
+
+                                if(!TXQ_EMPTY(tcb)){
+                                        struct txcontrolbuf * last = TXQ_AT(tcb,tcb->txq_tail-1);
+                                        shifter = TXQ_AT(tcb,tcb->txq_head)->seq;
+                                        ;//printf("Processing ack  %d\n", htonl(tcp->ack)-tcb->seq_offs);
+                                        if((htonl(tcp->ack)-shifter) <= (last->seq + last->payloadlen - shifter + 1)){ // +1 is to compensate the FIN
+                                                 while(!TXQ_EMPTY(tcb) && ((htonl(tcp->ack)-shifter) >= (TXQ_AT(tcb,tcb->txq_head)->seq-shifter + TXQ_AT(tcb,tcb->txq_head)->payloadlen + ((TXQ_AT(tcb,tcb->txq_head)->flags&FIN) ? 1 : 0)))){ //Ack>=Seq+payloadlen(+FIN)
+                                                        struct txcontrolbuf * temp = TXQ_AT(tcb,tcb->txq_head);
+                                                                ;//printf("Removing seq %d\n",temp->seq-tcb->seq_offs);
+                                                                fdinfo[i].tcb->txfree+=temp->payloadlen;
 #ifdef CONGCTRL
-                                                                        if(htonl(tcp->ack)-shifter ==(htonl(temp->segment->seq)-shifter + temp->payloadlen)) // Exact ACK matching: estimates
-                                                                        if(temp->payloadlen!=0) // if not a piggybacked ACK of an ACK
-                                                                                 if(temp->retry<=1) // if never retransmitted or no other segment in the window has been retransmitted.
-                                                                                        rtt_estimate(tcb,temp);
-                                                                                fdinfo[i].tcb->flightsize-=temp->payloadlen;
-#endif
-                                                                                free(temp->segment);
-                                                                                free(temp);
-                                                                                if(tcb->txfirst == NULL) tcb->txlast = NULL;
-                                                                }//While
+                                                        if(!has_ts) //no timestamps: Karn
+                                                        if(htonl(tcp->ack)-shifter ==(temp->seq-shifter + temp->payloadlen)) // Exact ACK matching: estimates
+                                                        if(temp->payloadlen!=0) // if not a piggybacked ACK of an ACK
+                                                                 if(temp->retry==1) // if never retransmitted or no other segment in the window has been retransmitted.
+                                                                        rtt_estimate(i,tcb,ts_now() - temp->tsval);
+                                                                fdinfo[i].tcb->flightsize-=temp->payloadlen;
+#endif
+                                                                tcb->txq_head++; //the ring slot and its bytes are released together
+                                                }//While
+#ifdef CONGCTRL
+                                                 if(has_ts && (int)(htonl(tcp->ack)-shifter) > 0) //every ACK of new data is a sample, retransmitted or not
+                                                        rtt_estimate(i,tcb,ts_now() - tsecr);
+#endif
+                                                 sack_update(tcb,tcp);
 #ifdef CONGCTRL
-                                                                 congctrl_fsm(tcb,PKT_RCV,tcp,streamsegmentsize);
+                                                 congctrl_fsm(i,tcb,PKT_RCV,tcp,streamsegmentsize);
 #endif
 
-                                                                tcb->radwin =   htons(tcp->window);
-                                                        }
-                                                }
+                                                if(!(tcp->flags&SYN)) tcb->radwin =   htons(tcp->window) << tcb->snd_wscale; //never scaled in a SYN
+                                        }
+                                }
 
-                                                if(((stream_offs + streamsegmentsize - tcb->rx_win_start)<RXBUFSIZE)){
-                                                        newrx = (struct rxcontrol *) malloc(sizeof(struct rxcontrol));
-                                                        newrx->stream_offs = stream_offs;
-                                                        newrx->streamsegmentsize = streamsegmentsize;
-                                                        if(tcp->flags&FIN) {
-                                                                                printf("End of stream SEQ: %d\n",tcb->stream_end);
-                                                                                tcb->stream_end=stream_offs + streamsegmentsize;
-                                                                                printf("End of stream SEQ: %d\n",tcb->stream_end);
-                                                                                newrx->streamsegmentsize++;
-                                                                                }
-                                                        for(prev = curr = tcb->unack; curr!=NULL && curr->stream_offs<stream_offs; curr = (prev = curr)->next);
-                                                        if((stream_offs<tcb->cumulativeack) || (curr!=NULL && curr->stream_offs==stream_offs))
-                                                                        free(newrx);  //Duplicate or old packet: not to attach
-                                                        else {
-                                                                for(int k=0; k<streamsegmentsize;k++)
-                                                                        tcb->rxbuffer[(stream_offs+k)%RXBUFSIZE] = streamsegment[k];
-
-                                                                if ( prev == curr) { //Add to the head : empty queue
-                                                                        tcb->unack = newrx;
-                                                                        newrx->next = prev;
-                                                                        ;//printf("%d %d %d\n", (prev==NULL)?-1:prev->stream_offs, stream_offs, (curr==NULL)?-1:curr->stream_offs);
-                                                                        }
-                                                                else { //Add after curr
-                                                                        prev->next = newrx;
-                                                                        newrx->next = curr; //No matter whether null or not.
-                                                                        ;//printf("%d %d %d\n", (prev==NULL)?-1:prev->stream_offs, stream_offs, (curr==NULL)?-1:curr->stream_offs);
-                                                                                }
-                                                                printf(" Inserted: ");printrxq(tcb->unack);
-
-                                                                while((tcb->unack != NULL) && (tcb->unack->stream_offs == tcb->cumulativeack)){
-                                                                        struct rxcontrol * tmp;
-                                                                        tmp = tcb->unack;
-                                                                        tcb->cumulativeack += tcb->unack->streamsegmentsize;
-                                                                        tcb->adwin = RXBUFSIZE- (tcb->cumulativeack - tcb->rx_win_start);
-                                                                        tcb->unack = tcb->unack->next;
-                                                                        free(tmp);
-                                                                        }
-                                                                printf(" Removed: ");printrxq(tcb->unack);
-                                                                }
-                                                        //printf("Preparing ACK\n");
-                                                        if(tcb->txfirst==NULL && tcb->st!=TIME_WAIT){
-                                                                prepare_tcp(i,ACK,NULL,0,NULL,0);
+                                if(((stream_offs + streamsegmentsize - tcb->rx_win_start)<tcb->rxbufsize)){
+                                        unsigned int ackbefore = tcb->cumulativeack;
+                                        int inorder = (stream_offs == tcb->cumulativeack);
+                                        int hasdata = streamsegmentsize || (tcp->flags&FIN);
+                                        rangeend = stream_offs + streamsegmentsize;
+                                        if(tcp->flags&FIN) {
+                                                                LOG_TRACE("End of stream SEQ: %d\n",tcb->stream_end);
+                                                                tcb->stream_end=stream_offs + streamsegmentsize;
+                                                                LOG_TRACE("End of stream SEQ: %d\n",tcb->stream_end);
+                                                                rangeend++;
                                                                 }
+                                        if(stream_offs<tcb->cumulativeack){ //Old bytes: keep only the new tail, if any
+                                                        unsigned int old = MIN(tcb->cumulativeack - stream_offs, streamsegmentsize);
+                                                        streamsegment += old;
+                                                        streamsegmentsize -= old;
+                                                        stream_offs += old;
+                                                        }
+                                        if((rangeend > tcb->cumulativeack) && (rangeend > stream_offs) && (rx_insert(tcb, stream_offs, rangeend) == 0)){
+                                                unsigned int offs = stream_offs % tcb->rxbufsize;
+                                                tcb->rx_last = stream_offs;
+                                                if(stream_offs != tcb->cumulativeack) TCB_STAT_ADD(tcb, ooo_bytes, streamsegmentsize);
+                                                int first = MIN(streamsegmentsize, tcb->rxbufsize - offs);
+                                                memcpy(tcb->rxbuffer + offs, streamsegment, first);
+                                                memcpy(tcb->rxbuffer, streamsegment + first, streamsegmentsize - first);
+                                                LOG_TRACE(" Inserted: ");printrxq(tcb);
+
+                                                if((tcb->rxq_n > 0) && (tcb->rxq[0].start == tcb->cumulativeack)){
+                                                        tcb->cumulativeack = tcb->rxq[0].end;
+                                                        tcb->adwin = tcb->rxbufsize- (tcb->cumulativeack - tcb->rx_win_start);
+                                                        memmove(tcb->rxq, tcb->rxq + 1, (--tcb->rxq_n)*sizeof(struct rxrange));
+                                                        }
+                                                LOG_TRACE(" Removed: ");printrxq(tcb);
+                                                }
+                                        /* Pure ACKs answer data or FIN only. Anything that tells the
+                                         * sender about a loss (out of order, holes, duplicates, a filled
+                                         * gap) or ends the stream is acked at once; in order data every
+                                         * second full segment or when the delayed ACK timer fires. */
+                                        if(hasdata){
+                                                if(!inorder || tcb->rxq_n || (tcp->flags&FIN) || tcb->cumulativeack == ackbefore || tcb->cumulativeack != rangeend)
+                                                        send_ack(i, tcb->snd_max);
+                                                else if((tcb->ack_pending += tcb->cumulativeack - ackbefore) >= 2*tcb->mss)
+                                                        send_ack(i, tcb->snd_max);
+                                                else if(!TW_ARMED(i,TW_DELACK))
+                                                        tw_arm(TW(i,TW_DELACK), tick + DELACK_TICKS);
                                                 }
-                                break;
-                                }// End of segment processing
-                }//If TCP protocol
-        }//IF ethernet
-}//While packet
-if (( errno != EAGAIN) && (errno!= EINTR )) { perror("Packet recvfrom Error\n"); }
-}
-fds[0].events= POLLIN|POLLOUT;
-fds[0].revents=0;
+                                }
+                }// End of segment processing
+}//If TCP protocol
+}//IF ethernet
+}
+
+#ifdef SHARDS
+/* Runs on the owner what other threads handed over, see handoff_frame() */
+void handoff_drain(){
+struct handoff * h = &handoff[me];
+struct handoff_slot * sl;
+int s, next, ops;
+for(sl = &h->slot[h->tail % HANDOFF_SLOTS]; __atomic_load_n(&sl->seq, __ATOMIC_ACQUIRE) == h->tail+1; sl = &h->slot[h->tail % HANDOFF_SLOTS]){
+        process_frame(sl->frame, sl->size);
+        __atomic_store_n(&sl->seq, h->tail + HANDOFF_SLOTS, __ATOMIC_RELEASE); //free for the next lap
+        h->tail++;
+        }
+for(s = __atomic_exchange_n(&h->ops, 0, __ATOMIC_ACQUIRE); s != 0; s = next){
+        next = handoff_next[s]; //s may be pushed again once its ops are taken
+        ops = __atomic_exchange_n(&handoff_ops[s], 0, __ATOMIC_ACQ_REL);
+        if(fdinfo[s].st != TCB_CREATED || !SHARD_MINE(s)) continue;
+        if(ops & HO_KICK) tx_kick(s);
+        if(ops & HO_KEEPALIVE) keepalive_arm(s);
+        if(ops & HO_ACK) ack_now(s);
+        }
+}
+#endif
+
+/* RX path: whatever the link has received */
+void myio(int number)
+{
+if(-1 == STACK_LOCK()){perror("stack lock"); return ;}
+fl++;
 if (fl > 1) ;//printf("Overlap (%d) in myio\n",fl);
-        //printbuf(eth,size);
+phy->recv();
+tx_flush();
 fl--;
-if(-1 == sigprocmask(SIG_UNBLOCK, &mymask, NULL)){perror("sigprocmask"); return ;}
+if(-1 == STACK_UNLOCK()){perror("stack unlock"); return ;}
 }
 
 int mylisten(int s, int bl){
@@ -1153,6 +3031,15 @@ fdinfo[s].tcb->st = LISTEN; /*Marking socket as passive opener*/
 fdinfo[s].tcblist = (struct tcpctrlblk *) malloc (bl * sizeof(struct tcpctrlblk));
 bzero(fdinfo[s].tcblist,bl* sizeof(struct tcpctrlblk));
 fdinfo[s].bl = bl; //Backlog length size;
+fdinfo[s].bl_head = fdinfo[s].bl_count = 0;
+#ifdef SHARDS
+fdinfo[s].shard = shard_of(0, 0, fdinfo[s].l_addr, fdinfo[s].l_port); //handshakes run there, other members hand their frames over
+#endif
+SHARD_ENTER(s);
+STACK_LOCK(); //the engine walks listenhash
+hash_insert(listenhash, port_hashfn(fdinfo[s].l_port), s);
+STACK_UNLOCK();
+return 0;
 }
 
 int myaccept(int s, struct sockaddr * addr, int * len)
@@ -1161,13 +3048,15 @@ int i,j;
 if (addr->sa_family == AF_INET){
   struct sockaddr_in * a = (struct sockaddr_in *) addr;
   *len = sizeof(struct sockaddr_in);
-  if (fdinfo[s].tcb->st!=LISTEN) {myerrno=EBADF; return -1;}
-  if (fdinfo[s].tcblist == NULL) {myerrno=EBADF; return -1;}
+  if (s < 3 || s >= MAX_FD) {myerrno=EBADF; return -1;}
+  SHARD_ENTER(s);
+  STACK_LOCK();
   do{
-      for(i=0;i<fdinfo[s].bl;i++){
-        if(fdinfo[s].tcblist[i].st==ESTABLISHED){ //Not Fifo Queue
-          for(j=3;j<MAX_FD && fdinfo[j].st!=FREE;j++); // Searching for free d
-          if (j == MAX_FD) { myerrno=ENFILE; return -1;} //Not free descriptor
+      if (fdinfo[s].st != TCB_CREATED || fdinfo[s].tcblist == NULL) { STACK_UNLOCK(); myerrno=EBADF; return -1;} //again after every wait: closed meanwhile
+      if(fdinfo[s].bl_count){ //Fifo Queue: oldest pending connection first
+          i = fdinfo[s].bl_head;
+          j = fd_alloc();
+          if (j == -1) { STACK_UNLOCK(); myerrno=ENFILE; return -1;} //Not free descriptor
           else  { //Free File descriptor found
             fdinfo[j]=fdinfo[s];
                                                 fdinfo[j].tcb=(struct tcpctrlblk *) malloc(sizeof(struct tcpctrlblk));
@@ -1175,46 +3064,609 @@ if (addr->sa_family == AF_INET){
             a->sin_port = fdinfo[j].tcb->r_port; //report on remote port
             a->sin_addr.s_addr = fdinfo[j].tcb->r_addr;//report on remote IP a
             fdinfo[j].bl=0; //twin socket has not backlog queue
+            fdinfo[j].tcblist = NULL;
+            fdinfo[j].users = 0;
+            fdinfo[j].nonblock = 0; //as accept(2): flags are not inherited
+            fdinfo[j].epmask = 0;
+            __atomic_fetch_add(&port_refs[fdinfo[j].l_port], 1, __ATOMIC_RELAXED); //shares the listener's port
+            fdinfo[j].bl_head = fdinfo[j].bl_count = 0;
             fdinfo[s].tcblist[i].st=FREE;
-                                                printf("%.7ld: Reset clock\n",rtclock(1));
-            prepare_tcp(j,ACK,NULL,0,NULL,0);
+            fdinfo[s].bl_head = (fdinfo[s].bl_head + 1) % fdinfo[s].bl;
+            fdinfo[s].bl_count--;
+#ifdef SHARDS
+            fdinfo[j].shard = shard_of(fdinfo[j].tcb->r_addr, fdinfo[j].tcb->r_port, fdinfo[j].l_addr, fdinfo[j].l_port);
+            STACK_UNLOCK(); //from here on j is run by the member its frames reach
+            SHARD_ENTER(j);
+            STACK_LOCK();
+#endif
+            hash_insert(connhash, conn_hashfn(fdinfo[j].tcb->r_addr,fdinfo[j].tcb->r_port,fdinfo[j].l_port,fdinfo[j].l_addr), j);
+                                                rtclock(1); LOG_TRACE("%.7ld: Reset clock\n",rtclock(0));
+            ack_now(j);
+            keepalive_arm(j);
+            STACK_UNLOCK();
             return j; //New socket connect is returned
           }
         }//if pending connection
-      }//for each fd
-    } while(pause()); //Accept never ends
+      if(fdinfo[s].nonblock) { STACK_UNLOCK(); myerrno=EAGAIN; return -1;}
+    } while(STACK_WAIT()); //Accept never ends
   }else { myerrno=EINVAL; return -1;}
 }
 
+int myepoll_create(int size){
+int e, used;
+for(e=0; e<MAX_EPOLL; e++){
+        used = 0;
+        if(__atomic_compare_exchange_n(&eps[e].used, &used, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) break;
+        }
+if(e == MAX_EPOLL){ myerrno = EMFILE; return -1;}
+eps[e].events = (unsigned int *) calloc(MAX_FD, sizeof(unsigned int));
+eps[e].data = (epoll_data_t *) calloc(MAX_FD, sizeof(epoll_data_t));
+eps[e].queued = (unsigned char *) calloc(MAX_FD, 1);
+eps[e].ready = (int *) calloc(MAX_FD, sizeof(int));
+eps[e].ready_head = eps[e].ready_n = 0;
+#ifdef EVLOOP
+pthread_condattr_t cattr;
+pthread_condattr_init(&cattr);
+pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC); //deadlines from monotonic_ns()
+pthread_mutex_init(&eps[e].mtx, NULL);
+pthread_cond_init(&eps[e].cv, &cattr);
+eps[e].waiters = 0;
+#endif
+return e;
+}
+
+int myepoll_ctl(int e, int op, int s, struct epoll_event * ev){
+unsigned int bit = 1u << e;
+if(e < 0 || e >= MAX_EPOLL || !eps[e].used){ myerrno = EBADF; return -1;}
+if(s < 3 || s >= MAX_FD || fdinfo[s].st == FREE){ myerrno = EBADF; return -1;}
+if(op != EPOLL_CTL_DEL && ev == NULL){ myerrno = EFAULT; return -1;}
+SHARD_ENTER(s);
+STACK_LOCK();
+if((op == EPOLL_CTL_ADD) == ((fdinfo[s].epmask & bit) != 0)){ //adding twice, or changing what is not there
+        STACK_UNLOCK();
+        myerrno = (op == EPOLL_CTL_ADD) ? EEXIST : ENOENT;
+        return -1;
+        }
+switch(op){
+        case EPOLL_CTL_ADD:
+        case EPOLL_CTL_MOD:
+                eps[e].events[s] = ev->events;
+                eps[e].data[s] = ev->data;
+                fdinfo[s].epmask |= bit;
+                sock_wake(s); //it may be ready already
+                break;
+        case EPOLL_CTL_DEL:
+                fdinfo[s].epmask &= ~bit; //a queued entry is dropped by myepoll_wait()
+                break;
+        default:
+                STACK_UNLOCK();
+                myerrno = EINVAL; return -1;
+        }
+STACK_UNLOCK();
+return 0;
+}
+
+int myepoll_close(int e){
+int s;
+if(e < 0 || e >= MAX_EPOLL || !eps[e].used){ myerrno = EBADF; return -1;}
+for(s=3; s<MAX_FD; s++)
+        if(fdinfo[s].epmask & 1u << e){
+                SHARD_ENTER(s);
+                STACK_LOCK();
+                fdinfo[s].epmask &= ~(1u << e);
+                STACK_UNLOCK();
+                }
+free(eps[e].events);
+free(eps[e].data);
+free(eps[e].queued);
+free(eps[e].ready);
+#ifdef EVLOOP
+pthread_mutex_destroy(&eps[e].mtx);
+pthread_cond_destroy(&eps[e].cv);
+#endif
+__atomic_store_n(&eps[e].used, 0, __ATOMIC_RELEASE);
+return 0;
+}
+
+/* Up to maxevents ready sockets of instance e; timeout in ms, -1 = forever */
+int myepoll_wait(int e, struct epoll_event * evs, int maxevents, int timeout){
+struct myepoll * ep = eps + e;
+long long deadline = monotonic_ns() + timeout*1000000LL;
+int n = 0, k, s, ev;
+if(e < 0 || e >= MAX_EPOLL || !eps[e].used){ myerrno = EBADF; return -1;}
+if(maxevents <= 0){ myerrno = EINVAL; return -1;}
+EP_LOCK(ep);
+while(1){
+        for(k = ep->ready_n; k > 0 && n < maxevents; k--){ //each queued fd once per pass
+                s = ep->ready[ep->ready_head];
+                ep->ready_head = (ep->ready_head + 1) % MAX_FD;
+                ep->ready_n--;
+                ep->queued[s] = 0; //from here a sock_wake() queues it again
+                EP_UNLOCK(ep);
+                SHARD_ENTER(s);
+                STACK_LOCK();
+                ev = (fdinfo[s].epmask & 1u << e) ? sock_events(s) & (ep->events[s] | POLLERR | POLLHUP) : 0;
+                if(ev){
+                        evs[n].events = ev;
+                        evs[n++].data = ep->data[s];
+                        }
+                STACK_UNLOCK();
+                EP_LOCK(ep);
+                if(ev) ep_queue(ep, s); //level triggered: looked at again next time
+                }
+        if(n || timeout == 0) break;
+#ifdef EVLOOP
+        struct timespec ts = { .tv_sec = deadline / 1000000000, .tv_nsec = deadline % 1000000000 };
+        ep->waiters++;
+        k = (timeout < 0) ? pthread_cond_wait(&ep->cv, &ep->mtx) : pthread_cond_timedwait(&ep->cv, &ep->mtx, &ts);
+        ep->waiters--;
+        if(k == ETIMEDOUT) break;
+#else
+        (void) STACK_WAIT(); //a handler ran: at least every tick
+        if(timeout > 0 && monotonic_ns() >= deadline) break;
+#endif
+        }
+EP_UNLOCK(ep);
+return n;
+}
+
+/* poll(2) over our sockets: a first look, then a temporary myepoll instance
+ * to sleep on if none is ready */
+int mypoll(struct pollfd * fds, int nfds, int timeout){
+struct epoll_event ev;
+int i, n = 0, e;
+for(i=0; i<nfds; i++){
+        fds[i].revents = 0;
+        if(fds[i].fd < 0) continue;
+        if(fds[i].fd < 3 || fds[i].fd >= MAX_FD) fds[i].revents = POLLNVAL;
+        else {
+                SHARD_ENTER(fds[i].fd);
+                STACK_LOCK();
+                fds[i].revents = sock_events(fds[i].fd) & (fds[i].events | POLLERR | POLLHUP | POLLNVAL);
+                STACK_UNLOCK();
+                }
+        if(fds[i].revents) n++;
+        }
+if(n || timeout == 0) return n;
+if((e = myepoll_create(nfds)) == -1) return -1;
+for(i=0; i<nfds; i++){
+        if(fds[i].fd < 0) continue;
+        ev.events = fds[i].events;
+        ev.data.fd = fds[i].fd;
+        myepoll_ctl(e, EPOLL_CTL_ADD, fds[i].fd, &ev); //EEXIST for an fd listed twice
+        }
+n = myepoll_wait(e, &ev, 1, timeout);
+myepoll_close(e);
+return (n > 0) ? mypoll(fds, nfds, 0) : n;
+}
+
+/* Raw socket of the engine, or of the calling shard, and its RX ring */
+int packet_open(char * ifname){
+int v = TPACKET_V3;
+sll.sll_family = AF_PACKET;
+sll.sll_ifindex = if_nametoindex(ifname ? ifname : "eth0"); // looked up once, every frame goes out through sll
+if(sll.sll_ifindex == 0){ perror(ifname ? ifname : "eth0"); return -1;}
+unique_s = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL));
+if (unique_s == -1 ) { perror("Socket Failed"); return -1;}
+fdfl = fcntl(unique_s, F_GETFL, NULL); if(fdfl == -1) { perror("fcntl f_getfl"); return -1;}
+fdfl = fcntl(unique_s, F_SETFL,fdfl|O_NONBLOCK); if(fdfl == -1) { perror("fcntl f_setfl"); return -1;}
+rx_req.tp_block_size = RX_BLOCK_SIZE;
+rx_req.tp_block_nr = RX_BLOCK_NR;
+rx_req.tp_frame_size = 2048;
+rx_req.tp_frame_nr = RX_BLOCK_SIZE / 2048 * RX_BLOCK_NR;
+rx_req.tp_retire_blk_tov = RX_BLOCK_TOV;
+if( -1 == setsockopt(unique_s, SOL_PACKET, PACKET_VERSION, &v, sizeof(v)) ||
+    -1 == setsockopt(unique_s, SOL_PACKET, PACKET_RX_RING, &rx_req, sizeof(rx_req)) ||
+    MAP_FAILED == (rx_ring = mmap(NULL, RX_BLOCK_SIZE*RX_BLOCK_NR, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_LOCKED, unique_s, 0))){
+        perror("RX ring unavailable, using recvmmsg");
+        rx_ring = NULL;
+        }
+return 0;
+}
+
+/* AF_PACKET: drains the TPACKET_V3 ring when link_open() managed to map one,
+ * otherwise pulls up to RX_BATCH frames per recvmmsg() call. */
+void packet_recv(){
+int i,n;
+struct tpacket_block_desc * bd;
+struct tpacket3_hdr * ph;
+if(rx_ring != NULL){
+        for(bd = (struct tpacket_block_desc *)(rx_ring + rx_block*rx_req.tp_block_size);
+            bd->hdr.bh1.block_status & TP_STATUS_USER;
+            bd = (struct tpacket_block_desc *)(rx_ring + rx_block*rx_req.tp_block_size)){
+                ph = (struct tpacket3_hdr *)((unsigned char *)bd + bd->hdr.bh1.offset_to_first_pkt);
+                for(i=0;i<bd->hdr.bh1.num_pkts;i++){
+                        struct sockaddr_ll * from = (struct sockaddr_ll *)((unsigned char *)ph + TPACKET_ALIGN(sizeof(struct tpacket3_hdr)));
+                        if(from->sll_pkttype != PACKET_OUTGOING)
+                                process_frame((unsigned char *)ph + ph->tp_mac, ph->tp_snaplen);
+                        ph = (struct tpacket3_hdr *)((unsigned char *)ph + ph->tp_next_offset);
+                        }
+                __atomic_store_n(&bd->hdr.bh1.block_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+                rx_block = (rx_block+1)%rx_req.tp_block_nr;
+                }
+        }
+else {
+        do {
+                for(i=0;i<RX_BATCH;i++) rx_msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_ll);
+                n = recvmmsg(unique_s, rx_msgs, RX_BATCH, MSG_DONTWAIT, NULL);
+                for(i=0;i<n;i++)
+                        if(rx_from[i].sll_pkttype != PACKET_OUTGOING)
+                                process_frame(l2buffer[i], rx_msgs[i].msg_len);
+                } while (n == RX_BATCH);
+        if (n == -1 && ( errno != EAGAIN) && (errno!= EINTR )) { perror("Packet recvmmsg Error\n"); }
+        }
+}
+
+void packet_send(){
+int i,t;
+for(i=0; i<tx_n; i+=t){
+        t = sendmmsg(unique_s, tx_msgs+i, tx_n-i, 0);
+        if (t == -1) {perror("sendmmsg failed"); break;} // the rest is lost, retransmission recovers
+        STAT(tx_batches);
+        stack_cnt[SHARD_ID].tx_frames += t;
+        }
+}
+
+/* TAP: one frame per read() and write(), no header in front (IFF_NO_PI) */
+int tap_open(char * ifname){
+struct ifreq ifr;
+if((unique_s = open("/dev/net/tun", O_RDWR|O_NONBLOCK)) == -1){ perror("/dev/net/tun"); return -1;}
+bzero(&ifr, sizeof(ifr));
+ifr.ifr_flags = IFF_TAP | IFF_NO_PI;
+strncpy(ifr.ifr_name, ifname ? ifname : "tap0", IFNAMSIZ-1);
+if(-1 == ioctl(unique_s, TUNSETIFF, &ifr)){ perror("TUNSETIFF"); return -1;}
+return 0;
+}
+
+void tap_recv(){
+int n;
+while((n = read(unique_s, l2buffer[0], MAXFRAME)) > 0)
+        process_frame(l2buffer[0], n);
+if(n == -1 && errno != EAGAIN && errno != EINTR) perror("tap read");
+}
+
+void tap_send(){
+int i;
+for(i=0; i<tx_n; i++){
+        STAT(tx_batches); //one frame per call
+        if(-1 == write(unique_s, txframes[i], tx_iov[i].iov_len)) perror("tap write"); // lost, retransmission recovers
+        else STAT(tx_frames);
+        }
+}
+
+/* Virtual wire. Each end binds an AF_UNIX datagram socket to its own path
+ * and sends to the peer path; nothing arrives while the peer is not up.
+ * The sender is the link: a frame is lost with probability wire_loss,
+ * takes len/wire_rate to be serialized after the previous one, then
+ * wire_delay to arrive; with probability wire_reorder it is held
+ * WIRE_REORDER_NS more, so that the frames behind overtake it. Frames in
+ * flight wait in wire_q, a min-heap on the arrival time released every
+ * tick (TIMER_USECS resolution), and are tail dropped when it is full.
+ * Frames the peer's socket cannot take yet wait there too: the only
+ * losses are the emulated ones. */
+#define WIRE_QLEN 1024 // frames in flight: the bottleneck buffer
+#define WIRE_REORDER_NS 1000000LL
+struct wire_frame{
+long long due; //CLOCK_MONOTONIC ns it reaches the peer
+int len;
+unsigned char data[2000];
+}wire_q[WIRE_QLEN];
+int wire_heap[WIRE_QLEN], wire_n; //indices in wire_q
+int wire_free[WIRE_QLEN], wire_nfree;
+struct sockaddr_un wire_peer;
+long long wire_delay, wire_busy, wire_last; //ns: one way delay, end of the last serialization, last arrival in order
+unsigned long long wire_rate; //bytes/s, 0 = no limit
+double wire_loss, wire_reorder; //probabilities
+
+#define WIRE_DUE(k) (wire_q[wire_heap[k]].due)
+
+int wire_open(char * arg){
+struct sockaddr_un me = { .sun_family = AF_UNIX };
+char * local, * peer, * v;
+double d = 0, rate = 0, loss = 0, reorder = 0;
+int k;
+if(arg == NULL || (local = strtok(arg, ",")) == NULL || (peer = strtok(NULL, ",")) == NULL){
+        fprintf(stderr, "wire: MYTCP_LINK=wire:<local path>,<peer path>[,delay us,rate Mbit/s,loss %%,reorder %%]\n");
+        return -1;
+        }
+if((v = strtok(NULL, ",")) != NULL) d = atof(v);
+if((v = strtok(NULL, ",")) != NULL) rate = atof(v);
+if((v = strtok(NULL, ",")) != NULL) loss = atof(v);
+if((v = strtok(NULL, ",")) != NULL) reorder = atof(v);
+wire_delay = d*1000;
+wire_rate = rate*1000000/8;
+wire_loss = loss/100;
+wire_reorder = reorder/100;
+for(k=0; k<WIRE_QLEN; k++) wire_free[k] = k;
+wire_nfree = WIRE_QLEN;
+strncpy(me.sun_path, local, sizeof(me.sun_path)-1);
+wire_peer.sun_family = AF_UNIX;
+strncpy(wire_peer.sun_path, peer, sizeof(wire_peer.sun_path)-1);
+if((unique_s = socket(AF_UNIX, SOCK_DGRAM|SOCK_NONBLOCK, 0)) == -1){ perror("wire socket"); return -1;}
+unlink(local);
+if(-1 == bind(unique_s, (struct sockaddr *) &me, sizeof(me))){ perror(local); return -1;}
+printf("wire %s -> %s: delay %lld us, rate %.1f Mbit/s, loss %.2f%%, reorder %.2f%%\n", local, peer, wire_delay/1000, rate, loss, reorder);
+return 0;
+}
+
+/* -1: the peer's socket queue is full (a handful of frames, see
+ * net.unix.max_dgram_qlen), the frame waits in wire_q for the next tick */
+int wire_put(unsigned char * frame, int len){
+STAT(tx_batches); //one frame per call
+if(-1 != sendto(unique_s, frame, len, 0, (struct sockaddr *) &wire_peer, sizeof(wire_peer))){
+        STAT(tx_frames);
+        return 0;
+        }
+return (errno == EAGAIN || errno == ENOBUFS) ? -1 : 0; //peer down: lost as on a wire
+}
+
+void wire_swap(int a, int b){
+int t = wire_heap[a];
+wire_heap[a] = wire_heap[b];
+wire_heap[b] = t;
+}
+
+void wire_send(){
+int i, k, c;
+long long now = monotonic_ns(), due;
+for(i=0; i<tx_n; i++){
+        if(wire_loss && rand() < wire_loss*RAND_MAX) continue;
+        due = now;
+        if(wire_rate) due = wire_busy = MAX(wire_busy, now) + tx_iov[i].iov_len*1000000000LL/wire_rate;
+        due += wire_delay;
+        if(wire_reorder && rand() < wire_reorder*RAND_MAX) due += WIRE_REORDER_NS;
+        else due = wire_last = MAX(due, wire_last + 1); //FIFO among the frames not reordered
+        if(due <= now && wire_n == 0 && wire_put(txframes[i], tx_iov[i].iov_len) == 0) continue;
+        if(wire_nfree == 0) continue; //buffer full
+        k = wire_free[--wire_nfree];
+        wire_q[k].due = due;
+        wire_q[k].len = tx_iov[i].iov_len;
+        memcpy(wire_q[k].data, txframes[i], tx_iov[i].iov_len);
+        wire_heap[wire_n] = k;
+        for(c = wire_n++; c > 0 && WIRE_DUE(c) < WIRE_DUE((c-1)/2); c = (c-1)/2) wire_swap(c, (c-1)/2);
+        }
+}
+
+/* Frames whose time has come reach the peer */
+void wire_tick(){
+int k, c;
+long long now;
+if(wire_n == 0) return;
+now = monotonic_ns();
+while(wire_n && WIRE_DUE(0) <= now){
+        if(wire_put(wire_q[wire_heap[0]].data, wire_q[wire_heap[0]].len) == -1) break; //peer full: next tick
+        wire_free[wire_nfree++] = wire_heap[0];
+        wire_heap[0] = wire_heap[--wire_n];
+        for(k = 0; (c = 2*k+1) < wire_n; k = c){
+                if(c+1 < wire_n && WIRE_DUE(c+1) < WIRE_DUE(c)) c++;
+                if(WIRE_DUE(k) <= WIRE_DUE(c)) break;
+                wire_swap(k, c);
+                }
+        }
+}
+
+void wire_recv(){
+int n;
+while((n = recv(unique_s, l2buffer[0], MAXFRAME, MSG_DONTWAIT)) > 0)
+        process_frame(l2buffer[0], n);
+}
+
+struct link_ops links[] = {
+        { "packet", packet_open, packet_recv, packet_send, NULL },
+        { "tap", tap_open, tap_recv, tap_send, NULL },
+        { "wire", wire_open, wire_recv, wire_send, wire_tick },
+};
+#define LINK_N (sizeof(links)/sizeof(links[0]))
+
+/* Backend and addresses from the environment: MYTCP_LINK (see struct
+ * link_ops), MYTCP_IP=a.b.c.d[/prefix], MYTCP_GW=a.b.c.d and
+ * MYTCP_MAC=xx:xx:xx:xx:xx:xx replace the compiled in ones */
+int link_config(){
+char * v, * name, * slash, * end;
+unsigned int m[6];
+unsigned long prefix;
+int k;
+phy = &links[0];
+if((v = getenv("MYTCP_LINK")) != NULL){
+        name = strdup(v);
+        if((phy_arg = strchr(name, ':')) != NULL) *phy_arg++ = 0;
+        for(k=0; k<LINK_N && strcmp(links[k].name, name); k++);
+        if(k == LINK_N){ fprintf(stderr, "MYTCP_LINK: unknown link \"%s\"\n", name); return -1;}
+        phy = &links[k];
+        }
+#ifdef SHARDS
+if(phy != &links[0]){ fprintf(stderr, "SHARDS needs the packet link: its fanout group spreads the frames\n"); return -1;}
+#endif
+if((v = getenv("MYTCP_IP")) != NULL){
+        v = strdup(v);
+        if((slash = strchr(v, '/')) != NULL){
+                *slash = 0;
+                prefix = strtoul(slash+1, &end, 10);
+                if(end == slash+1 || *end || prefix > 32){ fprintf(stderr, "MYTCP_IP: bad prefix length\n"); return -1;}
+                *(unsigned int *) mask = (prefix == 0) ? 0 : htonl(0xFFFFFFFFu << (32 - prefix)); //a shift by 32 is undefined
+                }
+        if(inet_pton(AF_INET, v, myip) != 1){ fprintf(stderr, "MYTCP_IP: bad address\n"); return -1;}
+        }
+if((v = getenv("MYTCP_GW")) != NULL && inet_pton(AF_INET, v, gateway) != 1){ fprintf(stderr, "MYTCP_GW: bad address\n"); return -1;}
+if((v = getenv("MYTCP_MAC")) != NULL){
+        if(sscanf(v, "%x:%x:%x:%x:%x:%x", m, m+1, m+2, m+3, m+4, m+5) != 6){ fprintf(stderr, "MYTCP_MAC: bad address\n"); return -1;}
+        for(k=0; k<6; k++) mymac[k] = m[k];
+        }
+return 0;
+}
+
+int link_open(){
+return phy->open(phy_arg);
+}
+
+/* Points the RX/TX batch descriptors to the buffers of the calling thread */
+void batch_init(){
+int v;
+for(v=0;v<RX_BATCH;v++){
+        rx_iov[v].iov_base = l2buffer[v];
+        rx_iov[v].iov_len = MAXFRAME;
+        rx_msgs[v].msg_hdr.msg_iov = &rx_iov[v];
+        rx_msgs[v].msg_hdr.msg_iovlen = 1;
+        rx_msgs[v].msg_hdr.msg_name = &rx_from[v];
+        }
+for(v=0;v<TX_BATCH;v++){
+        tx_iov[v].iov_base = txframes[v];
+        tx_msgs[v].msg_hdr.msg_iov = &tx_iov[v];
+        tx_msgs[v].msg_hdr.msg_iovlen = 1;
+        tx_msgs[v].msg_hdr.msg_name = &sll;
+        tx_msgs[v].msg_hdr.msg_namelen = sizeof(sll);
+        }
+}
+
+#ifdef EVLOOP
+int evloop_init(){
+struct itimerspec tspec;
+struct epoll_event ev;
+tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+if (tfd == -1) { perror("timerfd_create"); return -1;}
+epfd = epoll_create1(0);
+if (epfd == -1) { perror("epoll_create1"); return -1;}
+ev.events = EPOLLIN; ev.data.fd = unique_s;
+if (-1 == epoll_ctl(epfd, EPOLL_CTL_ADD, unique_s, &ev)) { perror("epoll_ctl"); return -1;}
+ev.events = EPOLLIN; ev.data.fd = tfd;
+if (-1 == epoll_ctl(epfd, EPOLL_CTL_ADD, tfd, &ev)) { perror("epoll_ctl"); return -1;}
+#ifdef CONGCTRL
+pfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+if (pfd == -1) { perror("timerfd_create"); return -1;}
+ev.events = EPOLLIN; ev.data.fd = pfd;
+if (-1 == epoll_ctl(epfd, EPOLL_CTL_ADD, pfd, &ev)) { perror("epoll_ctl"); return -1;}
+#endif
+#ifdef SHARDS
+ev.events = EPOLLIN; ev.data.fd = handoff[me].efd;
+if (-1 == epoll_ctl(epfd, EPOLL_CTL_ADD, handoff[me].efd, &ev)) { perror("epoll_ctl"); return -1;}
+#endif
+tspec.it_interval.tv_sec = 0; tspec.it_interval.tv_nsec = TIMER_USECS*1000;
+tspec.it_value = tspec.it_interval;
+if( -1 == timerfd_settime(tfd, 0, &tspec, NULL)){perror("timerfd_settime"); return -1;}
+return 0;
+}
+
+/* Event loop thread: replaces the SIGIO and SIGALRM handlers.
+ * SHARDS: one per shard, arg is the shard number. */
+void * evloop(void * arg){
+struct epoll_event ev[4];
+unsigned long long expirations;
+int n,k;
+#ifdef SHARDS
+me = (long) arg;
+is_worker = 1;
+unique_s = shard_sock[me];
+rx_ring = shard_ring[me];
+batch_init();
+if(-1 == evloop_init()) return NULL;
+#endif
+while(1){
+        n = epoll_wait(epfd, ev, 4, -1);
+        if(n == -1){ if(errno == EINTR) continue; perror("epoll_wait"); return NULL;}
+        for(k=0;k<n;k++){
+                if(ev[k].data.fd == tfd){
+                        if(read(tfd,&expirations,sizeof(expirations)) != sizeof(expirations)) continue;
+                        STACK_LOCK();
+                        tick += expirations-1; // mytimer accounts for the last one
+                        mytimer(SIGALRM);
+                        STACK_UNLOCK();
+                }
+#ifdef CONGCTRL
+                else if(ev[k].data.fd == pfd){
+                        if(read(pfd,&expirations,sizeof(expirations)) != sizeof(expirations)) continue;
+                        mypace(SIGPACE);
+                }
+#endif
+#ifdef SHARDS
+                else if(ev[k].data.fd == handoff[me].efd){
+                        if(read(handoff[me].efd,&expirations,sizeof(expirations)) != sizeof(expirations)) continue;
+                        STACK_LOCK();
+                        handoff_drain();
+                        tx_flush();
+                        STACK_UNLOCK();
+                }
+#endif
+                else myio(SIGIO);
+        }
+        STACK_LOCK();
+        STACK_WAKE();
+        STACK_UNLOCK();
+}
+}
+#endif
 
 int main(int argc, char **argv)
 {
 clock_t start;
 fl = 0;
-struct itimerval myt;
+#ifndef EVLOOP
+struct itimerval myt; //signal engine tick
+#endif
+if(-1 == link_config()) return 1;
+#ifdef TRACE
+if(-1 == trace_open()) return 1;
+#endif
+#ifdef EVLOOP
+pthread_mutexattr_t mattr;
+pthread_mutexattr_init(&mattr);
+pthread_mutexattr_settype(&mattr, PTHREAD_MUTEX_RECURSIVE); // evloop holds it around mytimer
+#endif
+#ifdef SHARDS
+pthread_t evthread[NSHARDS];
+int v;
+unsigned int fanout = (getpid() & 0xFFFF) | (unsigned int)(PACKET_FANOUT_CBPF | PACKET_FANOUT_FLAG_DEFRAG) << 16;
+int k;
+for(v=0;v<NSHARDS;v++){ //joined in order: member v of the fanout group is shard v
+        pthread_mutex_init(&stack_mtx[v], &mattr);
+        pthread_cond_init(&stack_cv[v], NULL);
+        if(-1 == link_open()) return 1;
+        if(-1 == setsockopt(unique_s, SOL_PACKET, PACKET_FANOUT, &fanout, sizeof(fanout))){ perror("PACKET_FANOUT"); return 1;}
+        if(v == 0 && -1 == setsockopt(unique_s, SOL_PACKET, PACKET_FANOUT_DATA, &fanout_prog, sizeof(fanout_prog))){ perror("PACKET_FANOUT_DATA"); return 1;}
+        shard_sock[v] = unique_s;
+        shard_ring[v] = rx_ring;
+        for(k=0;k<HANDOFF_SLOTS;k++) handoff[v].slot[k].seq = k;
+        handoff[v].efd = eventfd(0, EFD_NONBLOCK);
+        if(handoff[v].efd == -1){ perror("eventfd"); return 1;}
+        }
+for(v=0;v<NSHARDS;v++)
+        if( pthread_create(&evthread[v], NULL, evloop, (void *)(long) v)){perror("pthread_create"); return 1;}
+#elif defined(EVLOOP)
+pthread_t evthread;
+pthread_mutex_init(&stack_mtx, &mattr);
+if(-1 == link_open()) return 1;
+batch_init();
+if(-1 == evloop_init()) return 1;
+if( pthread_create(&evthread, NULL, evloop, NULL)){perror("pthread_create"); return 1;}
+#else
+if(-1 == link_open()) return 1;
+batch_init();
 action_io.sa_handler = myio;
 action_timer.sa_handler = mytimer;
 sigaction(SIGIO, &action_io, NULL);
 sigaction(SIGALRM, &action_timer, NULL);
-unique_s = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL));
-if (unique_s == -1 ) { perror("Socket Failed"); return 1;}
+#ifdef CONGCTRL
+struct sigevent sev = { .sigev_notify = SIGEV_SIGNAL, .sigev_signo = SIGPACE };
+action_pace.sa_handler = mypace;
+sigaction(SIGPACE, &action_pace, NULL);
+if (-1 == timer_create(CLOCK_MONOTONIC, &sev, &pacetimer)){ perror("timer_create"); return 1;}
+#endif
 if (-1 == fcntl(unique_s, F_SETOWN, getpid())){ perror("fcntl setown"); return 1;}
 fdfl = fcntl(unique_s, F_GETFL, NULL); if(fdfl == -1) { perror("fcntl f_getfl"); return 1;}
 fdfl = fcntl(unique_s, F_SETFL,fdfl|O_ASYNC|O_NONBLOCK); if(fdfl == -1) { perror("fcntl f_setfl"); return 1;}
-fds[0].fd = unique_s;
-fds[0].events= POLLIN|POLLOUT;
-fds[0].revents=0;
-sll.sll_family = AF_PACKET;
-sll.sll_ifindex = if_nametoindex("eth0");
 myt.it_interval.tv_sec=0; /* Interval for periodic timer */
 myt.it_interval.tv_usec=TIMER_USECS; /* Interval for periodic timer */
 myt.it_value.tv_sec=0;    /* Time until next expiration */
 myt.it_value.tv_usec=TIMER_USECS;    /* Time until next expiration */
+if( -1 == sigemptyset(&waitmask)) {perror("Sigemtpyset"); return 1;}
 if( -1 == sigemptyset(&mymask)) {perror("Sigemtpyset"); return 1;}
 if( -1 == sigaddset(&mymask, SIGIO)){perror("Sigaddset");return 1;}
 if( -1 == sigaddset(&mymask, SIGALRM)){perror("Sigaddset");return 1;}
+#ifdef CONGCTRL
+if( -1 == sigaddset(&mymask, SIGPACE)){perror("Sigaddset");return 1;}
+#endif
 if( -1 == sigprocmask(SIG_UNBLOCK, &mymask, NULL)){perror("sigprocmask"); return 1;}
 if( -1 == setitimer(ITIMER_REAL, &myt, NULL)){perror("Setitimer"); return 1;}
+#endif
 if(argc == 1){ printf(usage_string,argv[0]); return 1;}
 g_argv = argv;
 g_argc = argc;
@@ -1228,12 +3680,17 @@ unsigned char * httpreq = "GET / HTTP/1.1\r\nAccept:text/html,application/xhtml+
 
 
 unsigned char httpresp[500000];
+char getreq[300];
 int s;
 struct sockaddr_in addr, loc_addr;
+if(getenv("MYTCP_GET") != NULL){ //another path, e.g. from a mytcp server over the wire link
+        snprintf(getreq, sizeof(getreq), "GET %.200s HTTP/1.1\r\nHost: mytcp\r\nConnection: close\r\n\r\n", getenv("MYTCP_GET"));
+        httpreq = (unsigned char *) getreq;
+        }
 s=mysocket(AF_INET,SOCK_STREAM,0);
 addr.sin_family = AF_INET;
 addr.sin_port =htons(80);
-addr.sin_addr.s_addr = inet_addr("213.131.64.214");// www.midor.com.eg
+addr.sin_addr.s_addr = inet_addr(getenv("MYTCP_SERVER") ? getenv("MYTCP_SERVER") : "213.131.64.214");// www.midor.com.eg
 //addr.sin_addr.s_addr = inet_addr("172.217.169.4"); //google
 //addr.sin_addr.s_addr = inet_addr("199.231.164.68"); //faq
 //addr.sin_addr.s_addr = inet_addr("88.80.187.84");
@@ -1245,11 +3702,13 @@ loc_addr.sin_port =((argc>=2)?htons(atoi(argv[1])):htons(0));
 ;//printf("Local port = %d\n",htons(loc_addr.sin_port));
 loc_addr.sin_addr.s_addr = htonl(0);
 if( -1 == mybind(s,(struct sockaddr *) &loc_addr, sizeof(struct sockaddr_in))){myperror("mybind"); return 1;}
+long long t0 = monotonic_ns();
 if (-1 == myconnect(s,(struct sockaddr * )&addr,sizeof(struct sockaddr_in))){myperror("myconnect"); return 1;}
 printf("Sending Req... %s\n", httpreq);
 if ( mywrite(s,httpreq,strlen(httpreq))==1) { myperror("Mywrite Failed\n"); return -1;}
 for (w=0; t=myread(s,httpresp+w,500000-w);w+=t)
         if(t== -1){myperror("myread"); return 1;}
+printf("Response time = %lld us\n", (monotonic_ns() - t0)/1000); //connect to end of stream
 printf("Response size = %d\n",w);
 for(int u=0; u<w; u++){
                 printf("%c",httpresp[u]);
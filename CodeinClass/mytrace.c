@@ -0,0 +1,128 @@
+/* Decoder of the binary trace written by mytcp.c built with -DTRACE.
+ *   mytrace mytcp.trace            all events, time ordered, as text
+ *   mytrace -s 4 mytcp.trace       only socket 4
+ *   mytrace -g -s 4 mytcp.trace | gnuplot -p
+ *                                  time-sequence graph of socket 4: segments
+ *                                  sent (retransmissions in red), ACKs received,
+ *                                  cwnd and the RTO retransmissions
+ * The layout below must stay the same as in mytcp.c. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define TRACE_MAGIC 0x54524331
+#define TR_FSM 1
+#define TR_CWND 2
+#define TR_RTO 3
+#define TR_TX 4
+#define TR_RX 5
+#define TR_RTT 6
+
+struct trace_ev{
+long long ns;
+unsigned short type, sock;
+unsigned int a, b, c, d;
+};
+struct trace_hdr{
+unsigned int magic, bits, rings, evsize;
+};
+
+struct ev{ //an event and the shard that wrote it
+struct trace_ev e;
+int shard;
+};
+
+char * states[] = { "CLOSED","LISTEN","SYN_SENT","SYN_RECEIVED","ESTABLISHED","FIN_WAIT_1","FIN_WAIT_2","CLOSE_WAIT","CLOSING","LAST_ACK","TIME_WAIT" };
+char * cong[] = { "SLOW_START","CONG_AVOID","FAST_RECOV" };
+
+char * state_name(unsigned int st){
+return (st >= 10 && st <= 20) ? states[st-10] : "?";
+}
+
+int by_time(const void * x, const void * y){
+long long d = ((struct ev *) x)->e.ns - ((struct ev *) y)->e.ns;
+return (d > 0) - (d < 0);
+}
+
+void print_ev(struct ev * v, long long t0){
+struct trace_ev * e = &v->e;
+printf("%12.6f %d %3d ", (e->ns - t0)/1e9, v->shard, e->sock);
+switch(e->type){
+        case TR_FSM: printf("FSM  %s -> %s (input %u)\n", state_name(e->a), state_name(e->b), e->c); break;
+        case TR_CWND: printf("CWND %u ssthresh %u %s flight %u\n", e->a, e->b, (e->c < 3) ? cong[e->c] : "?", e->d); break;
+        case TR_RTO: printf("RTO  seq %u rto %u us retry %u\n", e->a, e->b, e->c); break;
+        case TR_TX: printf("TX   seq %u ack %u len %u flags 0x%.2x retry %u\n", e->a, e->b, e->c, e->d & 0xFF, e->d >> 8); break;
+        case TR_RX: printf("RX   seq %u ack %u len %u flags 0x%.2x win %u\n", e->a, e->b, e->c, e->d & 0xFF, e->d >> 8); break;
+        case TR_RTT: printf("RTT  sample %u srtt %u rttvar %u rto %u (us)\n", e->a, e->b, e->c, e->d); break;
+        default: printf("type %u?\n", e->type);
+        }
+}
+
+/* gnuplot script with the data inline */
+void plot(struct ev * v, int n, int sock, long long t0){
+int k;
+#define FOR_EACH(cond) for(k=0;k<n;k++) if(v[k].e.sock == sock && (cond))
+#define T(k) ((v[k].e.ns - t0)/1e9)
+printf("$tx << EOD\n");
+FOR_EACH(v[k].e.type == TR_TX && v[k].e.c && (v[k].e.d >> 8) <= 1) printf("%f %u %u\n", T(k), v[k].e.a, v[k].e.c);
+printf("EOD\n$retx << EOD\n");
+FOR_EACH(v[k].e.type == TR_TX && v[k].e.c && (v[k].e.d >> 8) > 1) printf("%f %u %u\n", T(k), v[k].e.a, v[k].e.c);
+printf("EOD\n$ack << EOD\n");
+FOR_EACH(v[k].e.type == TR_RX && (v[k].e.d & 0x10)) printf("%f %u\n", T(k), v[k].e.b);
+printf("EOD\n$rto << EOD\n");
+FOR_EACH(v[k].e.type == TR_RTO) printf("%f %u\n", T(k), v[k].e.a);
+printf("EOD\n$cwnd << EOD\n");
+FOR_EACH(v[k].e.type == TR_CWND) printf("%f %u\n", T(k), v[k].e.a);
+printf("EOD\n");
+printf("set title 'socket %d'\nset xlabel 'time (s)'\nset ylabel 'sequence'\nset y2label 'cwnd (bytes)'\nset y2tics\nset key top left\n", sock);
+printf("plot $tx using 1:2:(0):3 with vectors nohead lc rgb 'black' title 'sent', "
+        "$retx using 1:2:(0):3 with vectors nohead lw 2 lc rgb 'red' title 'retransmitted', "
+        "$ack using 1:2 with steps lc rgb 'blue' title 'acked', "
+        "$rto using 1:2 with points pt 2 lc rgb 'red' title 'RTO', "
+        "$cwnd using 1:2 axes x1y2 with steps lc rgb 'dark-green' title 'cwnd'\n");
+}
+
+int main(int argc, char ** argv){
+int i, fd, n = 0, sock = -1, graph = 0;
+unsigned int r;
+unsigned long long head, k, size;
+struct stat st;
+struct trace_hdr * h;
+unsigned char * m, * ring;
+struct ev * v;
+while((i = getopt(argc, argv, "gs:")) != -1)
+        if(i == 'g') graph = 1;
+        else if(i == 's') sock = atoi(optarg);
+        else { fprintf(stderr, "usage: %s [-g] [-s socket] tracefile\n", argv[0]); return 1;}
+if(optind >= argc){ fprintf(stderr, "usage: %s [-g] [-s socket] tracefile\n", argv[0]); return 1;}
+if((fd = open(argv[optind], O_RDONLY)) == -1 || fstat(fd, &st) == -1){ perror(argv[optind]); return 1;}
+if(st.st_size < 64){ fprintf(stderr, "%s: not a trace of this version\n", argv[optind]); return 1;} //not even the header
+m = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+if(m == MAP_FAILED){ perror("mmap"); return 1;}
+h = (struct trace_hdr *) m;
+if(h->magic != TRACE_MAGIC || h->evsize != sizeof(struct trace_ev)){ fprintf(stderr, "%s: not a trace of this version\n", argv[optind]); return 1;}
+if(h->bits > 24 || h->rings == 0 || h->rings > 64){ fprintf(stderr, "%s: bad header\n", argv[optind]); return 1;}
+size = 1ULL << h->bits;
+if((unsigned long long) st.st_size < 64 + h->rings * (32 + size * sizeof(struct trace_ev))){ fprintf(stderr, "%s: truncated\n", argv[optind]); return 1;}
+v = (struct ev *) malloc(h->rings * size * sizeof(struct ev));
+if(v == NULL){ perror("malloc"); return 1;}
+for(r = 0; r < h->rings; r++){ //ring r: head, padding to 32 bytes, then the events
+        ring = m + 64 + r * (32 + size * sizeof(struct trace_ev));
+        head = __atomic_load_n((unsigned long long *) ring, __ATOMIC_ACQUIRE);
+        for(k = (head > size) ? head - size : 0; k < head; k++){
+                v[n].e = ((struct trace_ev *)(ring + 32))[k & (size-1)];
+                v[n].shard = r;
+                if(sock == -1 && graph && v[n].e.type == TR_TX) sock = v[n].e.sock; //first one that sent
+                if(sock == -1 || v[n].e.sock == sock) n++;
+                }
+        }
+qsort(v, n, sizeof(struct ev), by_time);
+if(n == 0){ fprintf(stderr, "no events\n"); return 0;}
+if(graph) plot(v, n, sock, v[0].e.ns);
+else for(i=0;i<n;i++) print_ev(v+i, v[0].e.ns);
+return 0;
+}
@@ -0,0 +1,41 @@
+#!/bin/bash
+# Two mytcp instances joined by the wire link: a server and a client that
+# GETs a file from it. Fails unless the file arrives intact, then prints
+# latency (a 1 KB GET), goodput and client CPU per byte (a bulk GET);
+# latency and goodput use the client's own connect-to-last-byte time.
+#   ./wiretest.sh                      plain build, ideal wire
+#   CFLAGS=-DCONGCTRL WIRE=2000,100,0.5,1 ./wiretest.sh
+#                                      2 ms one way, 100 Mbit/s, 0.5% loss, 1% reordering
+# SRC (default mytcp.c), CC, CFLAGS and SIZE (bulk bytes, < 490000) may be set.
+SRC=${SRC:-mytcp.c}
+SIZE=${SIZE:-400000}
+WIRE=${WIRE:+,$WIRE}
+DIR=$(mktemp -d /tmp/wiretest.XXXXXX)
+trap 'kill $SRV 2>/dev/null; rm -rf $DIR' EXIT
+${CC:-gcc} -O2 -DLOG_LEVEL=0 $CFLAGS -o $DIR/mytcp $SRC -pthread -lm || exit 1
+head -c 768 /dev/urandom | base64 > $DIR/small.txt
+head -c $((SIZE*3/4)) /dev/urandom | base64 > $DIR/bulk.txt
+
+cd $DIR
+MYTCP_LINK=wire:$DIR/srv,$DIR/cln$WIRE MYTCP_IP=10.0.0.1/24 MYTCP_MAC=02:00:00:00:00:01 ./mytcp 80 > srv.out 2>&1 &
+SRV=$!
+sleep 0.2
+
+# get <file>: client run, the response is the last bytes of its output
+get(){
+MYTCP_LINK=wire:$DIR/cln,$DIR/srv$WIRE MYTCP_IP=10.0.0.2/24 MYTCP_MAC=02:00:00:00:00:02 MYTCP_SERVER=10.0.0.1 MYTCP_GET=/$1 \
+        timeout 60 ./mytcp $((5000 + RANDOM % 1000)) 100000 300 CLN > cln.out 2>&1 || { echo "FAIL: client exited with $? on $1" >&2; tail -5 cln.out >&2; exit 1; }
+n=$(sed -n 's/^Response size = //p' cln.out)
+[ -n "$n" ] && tail -c $n cln.out | tail -c +20 | cmp -s - $1 || { echo "FAIL: $1 did not arrive intact" >&2; exit 1; }
+}
+
+# us <file>: connect-to-end-of-stream time the client reported
+us(){ sed -n 's/^Response time = \([0-9]*\) us/\1/p' cln.out; }
+get small.txt; lat=$(us)
+TIMEFORMAT="%U %S"
+cpu=$( { time get bulk.txt > /dev/null; } 2>&1 ) || { echo "$cpu"; exit 1; }
+bulk=$(us); bytes=$(stat -c %s bulk.txt)
+echo "latency: $(awk "BEGIN{printf \"%.1f\", $lat/1000}") ms for $(stat -c %s small.txt) bytes, connect to last byte"
+set -- $cpu
+echo "bulk: $bytes bytes in $(awk "BEGIN{printf \"%.3f\", $bulk/1e6}") s, goodput $(awk "BEGIN{printf \"%.2f\", $bytes*8/$bulk}") Mbit/s, client CPU $(awk "BEGIN{printf \"%.1f\", ($1+$2)*1e9/$bytes}") ns/byte"
+echo PASS